@@ -0,0 +1,419 @@
+//Microbenchmarks for the per-frame hot paths, run against synthetic frames so no camera is needed.
+//Output is CSV on stdout: case,format,size,frames,ns_per_frame,frames_per_s,bytes_per_s
+//Usage: ./bench [filter] [seconds per case]
+#include "c920capture.h"
+#include "c920tee.h"
+#include "c920dvr.h"
+#include "c920scale.h"
+#include "c920mjpeg.h"
+
+//Synthetic frame
+struct bench_frame_t
+{
+    public: int format;
+    public: const char* format_name;
+    public: size_t width;
+    public: size_t height;
+    public: unsigned char* data;
+    public: size_t length;
+};
+
+//Benchmark body, processes one frame and returns the bytes it touched
+typedef size_t (*bench_fn)(bench_frame_t& frame, void* ctx);
+
+static const char* filter = NULL;
+static double seconds = 0.2;
+static unsigned int seed = 1;
+
+static const size_t sizes[][2] = { {320, 240}, {640, 480}, {1280, 720}, {1920, 1080} };
+
+static long long now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+//Entropy coded bytes without 00 00 sequences or stray 0xFF markers, good enough for H264 payloads and JPEG scans
+static void fill_payload(unsigned char* p, size_t n)
+{
+    for (size_t i=0; i<n; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        p[i] = 1 + (seed >> 16) % 254;
+    }
+}
+
+static size_t put(unsigned char* p, const unsigned char* bytes, size_t n)
+{
+    memcpy(p, bytes, n);
+    return n;
+}
+
+//YUYV: 2 bytes per pixel, a gradient so the scalers see real data
+static void make_yuyv(bench_frame_t& f)
+{
+    f.length = f.width * f.height * 2;
+    f.data = (unsigned char*) malloc(f.length);
+    for (size_t y=0; y<f.height; y++)
+        for (size_t x=0; x<f.width*2; x++)
+            f.data[y*f.width*2 + x] = (unsigned char)((x & 1) ? 128 + y : x / 2 + y);
+}
+
+//MJPEG: SOI, APP0, DQT, SOF0, SOS, scan data and EOI, roughly the size the C920 produces (no DHT, like UVC)
+static void make_mjpeg(bench_frame_t& f)
+{
+    static const unsigned char soi[] = { 0xFF, 0xD8 };
+    static const unsigned char app0[] = { 0xFF, 0xE0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0x00, 0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00 };
+    static const unsigned char eoi[] = { 0xFF, 0xD9 };
+    size_t scan = f.width * f.height / 6;
+
+    f.data = (unsigned char*) malloc(scan + 1024);
+    size_t n = 0;
+    n += put(f.data + n, soi, sizeof(soi));
+    n += put(f.data + n, app0, sizeof(app0));
+
+    unsigned char dqt[5 + 64] = { 0xFF, 0xDB, 0x00, 0x43, 0x00 };
+    for (int i=0; i<64; i++) dqt[5 + i] = 1 + i;
+    n += put(f.data + n, dqt, sizeof(dqt));
+
+    unsigned char sof[] = { 0xFF, 0xC0, 0x00, 0x11, 0x08,
+        (unsigned char)(f.height >> 8), (unsigned char)f.height, (unsigned char)(f.width >> 8), (unsigned char)f.width,
+        0x03, 0x01, 0x21, 0x00, 0x02, 0x11, 0x00, 0x03, 0x11, 0x00 };
+    n += put(f.data + n, sof, sizeof(sof));
+
+    static const unsigned char sos[] = { 0xFF, 0xDA, 0x00, 0x0C, 0x03, 0x01, 0x00, 0x02, 0x11, 0x03, 0x11, 0x00, 0x3F, 0x00 };
+    n += put(f.data + n, sos, sizeof(sos));
+
+    fill_payload(f.data + n, scan);
+    for (size_t i=0; i<scan; i+=97) f.data[n + i] = 0xFF, f.data[n + i + 1] = 0x00;  //Byte stuffing
+    n += scan;
+    n += put(f.data + n, eoi, sizeof(eoi));
+    f.length = n;
+}
+
+//H264: an IDR access unit (SPS, PPS, IDR slice) about the size of a 3 Mbit/s 30 fps keyframe
+static void make_h264(bench_frame_t& f)
+{
+    static const unsigned char sps[] = { 0x00, 0x00, 0x00, 0x01, 0x67, 0x64, 0x00, 0x28, 0xAC, 0x2B, 0x40, 0x3C, 0x01, 0x13, 0xF2, 0xC0, 0x3C, 0x48, 0x9A, 0x80 };
+    static const unsigned char pps[] = { 0x00, 0x00, 0x00, 0x01, 0x68, 0xEE, 0x3C, 0xB0 };
+    static const unsigned char idr[] = { 0x00, 0x00, 0x00, 0x01, 0x65, 0x88, 0x84 };
+    size_t slice = f.width * f.height / 8;
+
+    f.data = (unsigned char*) malloc(slice + 64);
+    size_t n = 0;
+    n += put(f.data + n, sps, sizeof(sps));
+    n += put(f.data + n, pps, sizeof(pps));
+    n += put(f.data + n, idr, sizeof(idr));
+    fill_payload(f.data + n, slice);
+    n += slice;
+    f.length = n;
+}
+
+//H264: a P access unit (one non-IDR slice) of the same size, h264_has_idr() has to scan all of it
+static void make_h264_p(bench_frame_t& p, const bench_frame_t& f)
+{
+    static const unsigned char slice[] = { 0x00, 0x00, 0x00, 0x01, 0x41, 0x9A, 0x02 };
+    p = f;
+    p.data = (unsigned char*) malloc(f.length);
+    size_t n = put(p.data, slice, sizeof(slice));
+    fill_payload(p.data + n, f.length - n);
+}
+
+static void make_frame(bench_frame_t& f, int format, size_t width, size_t height)
+{
+    f.format = format;
+    f.width = width;
+    f.height = height;
+    if (format == YUYV) { f.format_name = "YUYV"; make_yuyv(f); }
+    else if (format == MJPEG) { f.format_name = "MJPEG"; make_mjpeg(f); }
+    else { f.format_name = "H264"; make_h264(f); }
+}
+
+//Run a case for the configured time and print one CSV row
+static void run(const char* name, bench_frame_t& f, bench_fn fn, void* ctx)
+{
+    if (filter && !strstr(name, filter)) return;
+
+    //Warm up caches and branch predictors
+    for (int i=0; i<3; i++) fn(f, ctx);
+
+    unsigned long frames = 0;
+    unsigned long long bytes = 0;
+    long long start = now_ns(), elapsed = 0;
+    long long budget = (long long)(seconds * 1e9);
+    do
+    {
+        for (int i=0; i<8; i++) bytes += fn(f, ctx);
+        frames += 8;
+        elapsed = now_ns() - start;
+    } while (elapsed < budget);
+
+    double ns = (double)elapsed / frames;
+    printf("%s,%s,%zux%zu,%lu,%.1f,%.1f,%.0f\n", name, f.format_name, f.width, f.height,
+        frames, ns, 1e9 / ns, bytes * 1e9 / elapsed);
+    fflush(stdout);
+}
+
+/*****************************************************
+Callback dispatch as done by c920_device_t::process(). Only the call through
+the function pointer: DQBUF/QBUF need a device and are not part of it.
+******************************************************/
+static volatile size_t dispatched = 0;
+
+static int count_frame(void* data, size_t length, c920_parameters_t c920_parameters)
+{
+    dispatched += length + ((unsigned char*)data)[0];
+    return c920_parameters.frames;
+}
+
+static size_t bench_dispatch(bench_frame_t& f, void* ctx)
+{
+    c920_parameters_t& params = *(c920_parameters_t*)ctx;
+    params.cb(f.data, f.length, params);
+    return f.length;
+}
+
+/*****************************************************
+Output paths: direct fwrite + fflush as in capture.cpp, and the tee. They
+write into a pipe that a thread drains, like capture -o stdout | ffmpeg, so
+the bytes are really copied out (/dev/null only costs the syscall).
+******************************************************/
+struct bench_drain_t
+{
+    public: FILE* fp;
+    public: int fd;
+    public: pthread_t thread;
+};
+
+static void* drain_main(void* arg)
+{
+    static char buffer[1 << 16];
+    while (read(((bench_drain_t*)arg)->fd, buffer, sizeof(buffer)) > 0);
+    return NULL;
+}
+
+static void open_drain(bench_drain_t& d)
+{
+    int fds[2];
+    d.fp = pipe(fds) == 0 ? fdopen(fds[1], "wb") : NULL;
+    d.fd = fds[0];
+    if (!d.fp || pthread_create(&d.thread, NULL, drain_main, &d) != 0)
+    {
+        fprintf(stderr, "Unable to start pipe drain\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void close_drain(bench_drain_t& d)
+{
+    fclose(d.fp);
+    pthread_join(d.thread, NULL);
+    close(d.fd);
+}
+
+static size_t bench_fwrite(bench_frame_t& f, void* ctx)
+{
+    FILE* fp = (FILE*)ctx;
+    fwrite(f.data, 1, f.length, fp);
+    fflush(fp);
+    return f.length;
+}
+
+static size_t bench_tee(bench_frame_t& f, void* ctx)
+{
+    ((c920_tee_t*)ctx)->push(f.data, f.length, f.format != H264 || c920_device_t::h264_has_idr(f.data, f.length));
+    return f.length;
+}
+
+static size_t bench_dvr(bench_frame_t& f, void* ctx)
+{
+    ((c920_dvr_t*)ctx)->write(f.data, f.length, 0, true);
+    return f.length;
+}
+
+/*****************************************************
+YUYV resampling into a preallocated output
+******************************************************/
+struct bench_scale_t
+{
+    public: c920_resampler_t* resampler;
+    public: unsigned char* out;
+};
+
+static size_t bench_scale(bench_frame_t& f, void* ctx)
+{
+    bench_scale_t& s = *(bench_scale_t*)ctx;
+    s.resampler->process(f.data, s.out);
+    return f.length;
+}
+
+static void run_scale(const char* name, bench_frame_t& f, size_t x, size_t y, size_t w, size_t h, size_t out_w, size_t out_h, int kernel)
+{
+    if (filter && !strstr(name, filter)) return;
+    bench_scale_t s;
+    s.resampler = new c920_resampler_t(f.width, f.height, x, y, w, h, out_w, out_h, kernel);
+    s.out = (unsigned char*) malloc(s.resampler->size());
+    run(name, f, bench_scale, &s);
+    free(s.out);
+    delete s.resampler;
+}
+
+/*****************************************************
+Parsing kernels
+******************************************************/
+static size_t bench_h264_has_idr(bench_frame_t& f, void* ctx)
+{
+    dispatched += c920_device_t::h264_has_idr(f.data, f.length);
+    return f.length;
+}
+
+static size_t bench_h264_nals(bench_frame_t& f, void* ctx)
+{
+    c920_nal_reader_t reader(f.data, f.length);
+    c920_nal_t nal;
+    while (reader.next(nal)) dispatched += nal.type;
+    return f.length;
+}
+
+//ctx is a validator, with or without DHT insertion
+static size_t bench_mjpeg_validate(bench_frame_t& f, void* ctx)
+{
+    const void* out;
+    size_t length;
+    dispatched += ((c920_mjpeg_validator_t*)ctx)->process(f.data, f.length, out, length);
+    return f.length;
+}
+
+//ctx is an analyzer without outputs, as run live from process()
+static size_t bench_h264_analyze(bench_frame_t& f, void* ctx)
+{
+    static long long t = 0;
+    ((c920_h264_analyzer_t*)ctx)->analyze(f.data, f.length, t += 33333);
+    return f.length;
+}
+
+//ctx is a rewriter, the frame is rewritten as is
+static size_t bench_h264_rewrite(bench_frame_t& f, void* ctx)
+{
+    const void* out;
+    size_t length;
+    ((c920_h264_rewriter_t*)ctx)->rewrite(f.data, f.length, out, length);
+    return f.length;
+}
+
+//ctx is a rewriter that has seen the parameter sets, the frame is fed without them so they get injected
+static size_t bench_h264_inject(bench_frame_t& f, void* ctx)
+{
+    const unsigned char* end = f.data + f.length;
+    const unsigned char* idr = f.data;
+    while ((idr = c920_find_start_code(idr, end)) < end && (idr[3] & 0x1f) != NAL_IDR) idr += 3;
+
+    const void* out;
+    size_t length;
+    ((c920_h264_rewriter_t*)ctx)->rewrite(idr, end - idr, out, length);
+    return end - idr;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) filter = argv[1];
+    if (argc > 2) seconds = atof(argv[2]);
+
+    c920_parameters_t params;
+    CLEAR(params);
+    params.cb = count_frame;
+    params.frames = 1;
+
+    printf("case,format,size,frames,ns_per_frame,frames_per_s,bytes_per_s\n");
+
+    for (int format=YUYV; format<=H264; format++)
+    {
+        for (size_t s=0; s<sizeof(sizes)/sizeof(sizes[0]); s++)
+        {
+            bench_frame_t f;
+            make_frame(f, format, sizes[s][0], sizes[s][1]);
+
+            run("dispatch_callback", f, bench_dispatch, &params);
+
+            if (!filter || strstr("write_fwrite", filter))
+            {
+                bench_drain_t out;
+                open_drain(out);
+                run("write_fwrite", f, bench_fwrite, out.fp);
+                close_drain(out);
+            }
+
+            if (!filter || strstr("write_tee", filter))
+            {
+                bench_drain_t a, b;
+                open_drain(a);
+                open_drain(b);
+                c920_tee_t tee(f.length);
+                tee.add_sink(a.fp, 8, SINK_BLOCK);
+                tee.add_sink(b.fp, 4, SINK_DROP_UNTIL_KEYFRAME);
+                tee.start();
+                run("write_tee", f, bench_tee, &tee);
+                tee.stop();
+                close_drain(a);
+                close_drain(b);
+            }
+
+            if (!filter || strstr("write_dvr", filter))
+            {
+                char path[] = "/tmp/c920benchXXXXXX";
+                int fd = mkstemp(path);
+                if (fd != -1)
+                {
+                    close(fd);
+                    c920_dvr_t* ring = new c920_dvr_t(path, 64 * 1024 * 1024, 16384, format, f.width, f.height, 30, false);
+                    run("write_dvr", f, bench_dvr, ring);
+                    delete ring;
+                    unlink(path);
+                }
+            }
+
+            if (format == YUYV)
+            {
+                run_scale("scale_box_half", f, 0, 0, f.width, f.height, f.width / 2, f.height / 2, SCALE_BOX);
+                run_scale("scale_area_thumb", f, 0, 0, f.width, f.height, 160, 90, SCALE_AREA);
+                run_scale("scale_bilinear_thumb", f, 0, 0, f.width, f.height, 160, 90, SCALE_BILINEAR);
+                run_scale("scale_roi_crop", f, f.width / 4, f.height / 4, f.width / 2, f.height / 2, f.width / 2, f.height / 2, SCALE_AREA);
+            }
+
+            if (format == MJPEG)
+            {
+                c920_mjpeg_validator_t validate(f.length, false, f.width, f.height);
+                c920_mjpeg_validator_t dht(f.length, true, f.width, f.height);
+                run("mjpeg_validate", f, bench_mjpeg_validate, &validate);
+                run("mjpeg_dht", f, bench_mjpeg_validate, &dht);
+                if (validate.stats().corrupt) fprintf(stderr, "mjpeg_validate: synthetic frame reported corrupt\n");
+            }
+
+            if (format == H264)
+            {
+                //An IDR is found in the first bytes, the scan only costs on the frames without one
+                bench_frame_t p;
+                make_h264_p(p, f);
+                run("h264_has_idr", p, bench_h264_has_idr, NULL);
+                free(p.data);
+                run("h264_nals", f, bench_h264_nals, NULL);
+
+                c920_h264_analyzer_t analyzer(30, 3000000, 3000000, 1000, 3, NULL, NULL, 0);
+                run("h264_analyze", f, bench_h264_analyze, &analyzer);
+
+                c920_h264_rewriter_t annexb(f.length, H264_ANNEXB, false);
+                c920_h264_rewriter_t avcc(f.length, H264_AVCC, false);
+                c920_h264_rewriter_t inject(f.length, H264_ANNEXB, true);
+                bench_h264_rewrite(f, &inject);
+                run("h264_passthrough", f, bench_h264_rewrite, &annexb);
+                run("h264_to_avcc", f, bench_h264_rewrite, &avcc);
+                run("h264_inject", f, bench_h264_inject, &inject);
+            }
+
+            free(f.data);
+        }
+    }
+
+    return 0;
+}
@@ -13,6 +13,9 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -25,6 +28,7 @@
 #include <linux/uvcvideo.h>
 
 #include "uvch264.h"
+#include "c920h264.h"
 
 //Define V4L2 Pixel format
 #ifndef V4L2_PIX_FMT_H264
@@ -32,6 +36,11 @@
 #endif
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
 
+//UVCX_PICTURE_TYPE_CONTROL picture types
+#define PICTURE_TYPE_IFRAME       (0x0000)
+#define PICTURE_TYPE_IDR          (0x0001)
+#define PICTURE_TYPE_IDR_FULL     (0x0002)
+
 //Format Types
 const int YUYV = 0;
 const int MJPEG = 1;
@@ -79,6 +88,130 @@ struct c920_parameters_t
     public: c920_buffer_cb cb;
     public: void* pipe;
     public: int bitrate;
+    public: int cpu;        //CPU to pin the capture thread to, -1 leaves affinity alone
+    public: int priority;   //SCHED_FIFO priority of the capture thread, 0 keeps the normal scheduler
+    public: int stall_frames; //Recover after this many frame intervals without a frame, 0 throws after 2s
+    public: const char* tee;  //Extra sinks as path[:policy[:depth]],... next to the output pipe
+    public: int nal;          //H264 output framing, H264_ANNEXB or H264_AVCC
+    public: int inject;       //Put the cached SPS/PPS in front of every IDR that lacks them
+    public: const char* dvr;  //Circular DVR file as path[:megabytes[:overwrite]]
+    public: const char* analyze; //H264 analysis, "summary" on stderr or "csv[:PATH]" (stdout unless -o is stdout)
+    public: double spike;     //Frames this many times the target frame size are reported as spikes
+    public: const char* scale; //Reduced YUYV outputs as path:WxH[:kernel[:fps[:x,y,w,h]]]+...
+    public: int pull;         //Drive the device from an epoll loop through try_dequeue() instead of process()
+    public: const char* mjpeg; //MJPEG validation as drop|keep[,dht][,multipart][,files=PATTERN]
+};
+
+//Latency statistics in microseconds with a log2 histogram
+struct c920_latency_t
+{
+    public: static const int BUCKETS = 24;
+    public: unsigned long samples;
+    public: long min_us;
+    public: long max_us;
+    public: long long total_us;
+    public: unsigned long histogram[BUCKETS]; //Bucket i counts delays below 2^i microseconds
+
+    public: c920_latency_t() { reset(); }
+
+    public: void reset()
+    {
+        samples = 0;
+        min_us = max_us = 0;
+        total_us = 0;
+        memset(histogram, 0, sizeof(histogram));
+    }
+
+    public: void add(long us)
+    {
+        if (us < 0) us = 0;
+        if (samples == 0 || us < min_us) min_us = us;
+        if (us > max_us) max_us = us;
+        total_us += us;
+        samples++;
+
+        int i = 0;
+        while (i < BUCKETS-1 && (1L << i) <= us) i++;
+        histogram[i]++;
+    }
+
+    public: long mean_us() const { return samples ? (long)(total_us / (long long)samples) : 0; }
+
+    //Upper bound of the bucket holding the given fraction of samples (e.g. 0.99)
+    public: long percentile_us(double p) const
+    {
+        if (!samples) return 0;
+        unsigned long target = (unsigned long)(p * samples);
+        unsigned long seen = 0;
+        for (int i=0; i<BUCKETS; i++)
+        {
+            seen += histogram[i];
+            if (seen > target) return 1L << i;
+        }
+        return max_us;
+    }
+};
+
+//A dequeued frame, data points into the driver's mapped buffer
+struct c920_frame_t
+{
+    public: void* data;
+    public: size_t length;
+    public: unsigned int index;          //V4L2 buffer index
+    public: unsigned int sequence;       //V4L2 frame sequence number
+    public: unsigned int flags;          //V4L2_BUF_FLAG_*
+    public: long long timestamp_us;      //V4L2 buffer timestamp (CLOCK_MONOTONIC on current kernels)
+    public: unsigned long generation;    //Stream generation, bumped on every recovery
+};
+
+//Stall recovery counters for supervised capture
+struct c920_recovery_t
+{
+    public: unsigned long stalls;      //Frame timeouts detected
+    public: unsigned long errors;      //Failed select/DQBUF/QBUF
+    public: unsigned long resets;      //Recovered with STREAMOFF/STREAMON
+    public: unsigned long reopens;     //Recovered with a full reopen
+    public: unsigned long dropped;     //Frames held back waiting for an IDR
+    public: long last_downtime_ms;
+    public: long max_downtime_ms;
+    public: long long total_downtime_ms;
+};
+
+//try_dequeue() results
+const int PULL_WOULD_BLOCK = 0;   //Nothing ready, wait for the fd to become readable again
+const int PULL_FRAME = 1;         //The lease holds a frame
+const int PULL_REOPENING = 2;     //The device is being reopened and fd() is -1, retry from a timer
+
+class c920_device_t;
+
+/*****************************************************
+A frame dequeued with try_dequeue(). The buffer belongs to the caller until
+release(), which hands it back to the driver; the destructor releases too.
+Hold as few leases as possible, the driver only has num_buffers() to fill.
+A recovery or stop() requeues every buffer, leases from before it turn
+stale() and their data must no longer be read.
+******************************************************/
+class c920_lease_t
+{
+    private: c920_device_t* _device;
+    private: c920_frame_t _frame;
+
+    public: c920_lease_t() : _device(0) { CLEAR(_frame); }
+    public: ~c920_lease_t() { release(); }
+
+    public: bool held() const { return _device != 0; }
+    public: bool stale() const;
+    public: const c920_frame_t& frame() const { return _frame; }
+    public: const void* data() const { return _frame.data; }
+    public: size_t length() const { return _frame.length; }
+
+    //Give the buffer back to the driver, does nothing if nothing is held
+    public: void release();
+
+    private: c920_lease_t(const c920_lease_t&);
+    private: c920_lease_t& operator=(const c920_lease_t&);
+
+    friend class c920_device_t;
 };
 
 //Capture class
@@ -91,9 +224,112 @@ class c920_device_t
     private: struct _buffer { void* data; size_t length; };
     private: _buffer* _buffers;
     private: c920_parameters_t _c920_parameters;
+    private: c920_latency_t _latency;
+    private: long long _timestamp_us;   //Buffer timestamp of the last frame dequeue() returned
+    private: bool   _latency_sof;   //Some samples were stamped at start of frame, see sample_latency()
+    private: pthread_t _thread;
+    private: bool   _threaded;
+    private: bool   _thread_failed;
+    private: c920_exception_t _thread_error;
+    private: char*  _output_buffer;
+    private: bool   _resync;
+    private: long long _last_frame_us;
+    private: c920_recovery_t _recovery;
+    private: unsigned long _generation;
+    private: long _average_bitrate;
+    private: long _peak_bitrate;
+    private: size_t _leased;
+    private: long long _recovered_us;   //When the stream was last started or recovered
+    private: int _resets;               //Stream resets in a row that did not bring a frame back
+    private: bool _reopening;           //Device closed, next open attempt due at _reopen_at_us
+    private: int _reopen_attempts;
+    private: long long _reopen_at_us;
+    private: unsigned long _fd_serial;  //Bumped on every open, fd numbers are reused
+    private: size_t _width;
+    private: size_t _height;
+
+    friend class c920_lease_t;
+
+    //A UVC camera takes a few hundred ms after STREAMON to deliver, the first frame gets at least this long
+    public: static const long FIRST_FRAME_TIMEOUT_US = 2000000;
+
+    //Consecutive STREAMOFF/STREAMON cycles without a frame before the device is reopened instead
+    public: static const int MAX_RESETS = 3;
+
+    //Size of the preallocated stdio buffer used for the output pipe in real-time mode
+    public: static const size_t OUTPUT_BUFFER_SIZE = 4*1024*1024;
 
     //Constructor
-    public: c920_device_t(c920_parameters_t c920_parameters)
+    public: c920_device_t(c920_parameters_t c920_parameters) : _thread_error("")
+    {
+        _device_name = 0;
+        _playing = false;
+        _threaded = false;
+        _latency_sof = false;
+        _timestamp_us = 0;
+        _thread_failed = false;
+        _output_buffer = 0;
+        _fd = -1;
+        _fd_serial = 0;
+        _buffers = 0;
+        _num_buffers = 0;
+        _resync = false;
+        _last_frame_us = 0;
+        CLEAR(_recovery);
+        _generation = 0;
+        _average_bitrate = 0;
+        _peak_bitrate = 0;
+        _leased = 0;
+        _recovered_us = 0;
+        _resets = 0;
+        _reopening = false;
+        _reopen_attempts = 0;
+        _reopen_at_us = 0;
+        _width = 0;
+        _height = 0;
+        _c920_parameters = c920_parameters;
+
+        /*****************************************************
+        Copy the device name so we can use it in error messages and set callback
+        ******************************************************/
+        _device_name = (char*) malloc(strlen(c920_parameters.device_name)+1);
+        strcpy(_device_name, c920_parameters.device_name);
+
+        try { open_device(); }
+        catch (c920_exception_t &e)
+        {
+            close_device();
+            free(_device_name);
+            throw;
+        }
+        DEBUG("Done with setup of device %s", c920_parameters.device_name);
+    }
+
+    //Destructor
+    public: ~c920_device_t()
+    {
+        /*****************************************************
+        Stop capture thread and device playback
+        ******************************************************/
+        if (_threaded)
+        {
+            try { join_thread(); }
+            catch (c920_exception_t &e) { DEBUG("W: capture thread failed: %s", e.message()); }
+        }
+        if (_playing)
+        {
+            try { stop(); }
+            catch (c920_exception_t &e) { DEBUG("W: %s", e.message()); }
+        }
+
+        close_device();
+        if (_device_name) free(_device_name);
+        if (_c920_parameters.pipe) fclose((FILE*)_c920_parameters.pipe);
+        if (_output_buffer) free(_output_buffer);
+    }
+
+    //Open the device, negotiate format and frame rate, map and queue buffers
+    private: void open_device()
     {
         struct stat st;
         v4l2_capability cap;
@@ -103,10 +339,6 @@ class c920_device_t
         v4l2_requestbuffers req;
         v4l2_streamparm parm;
 
-        _device_name = 0;
-        _playing = false;
-        _c920_parameters = c920_parameters;
-
         memset(&cropcap, 0, sizeof(cropcap));
         memset(&crop, 0, sizeof(crop));
         memset(&fmt, 0, sizeof(fmt));
@@ -116,105 +348,108 @@ class c920_device_t
         /*****************************************************
         Get file status, check /dev/video*
         ******************************************************/
-        DEBUG("Identifying device %s", c920_parameters.device_name);
-        if (stat(c920_parameters.device_name, &st) == -1)
-            throw c920_exception_t("unable to identify device %s", c920_parameters.device_name);
+        DEBUG("Identifying device %s", _c920_parameters.device_name);
+        if (stat(_c920_parameters.device_name, &st) == -1)
+            throw c920_exception_t("unable to identify device %s", _c920_parameters.device_name);
 
         /*****************************************************
         Check if this is a device
         ******************************************************/
-        DEBUG("Testing to see if %s is a device", c920_parameters.device_name);
+        DEBUG("Testing to see if %s is a device", _c920_parameters.device_name);
         if (!S_ISCHR(st.st_mode))
-            throw c920_exception_t("%s is not a device", c920_parameters.device_name);\
+            throw c920_exception_t("%s is not a device", _c920_parameters.device_name);\
 
         /*****************************************************
         Open device
         ******************************************************/
-        DEBUG("Opening device %s as RDWR | NONBLOCK",c920_parameters.device_name);
-        if ((_fd = open(c920_parameters.device_name, O_RDWR | O_NONBLOCK, 0)) == -1)
-            throw c920_exception_t("cannot open device %s", c920_parameters.device_name);
+        DEBUG("Opening device %s as RDWR | NONBLOCK",_c920_parameters.device_name);
+        if ((_fd = open(_c920_parameters.device_name, O_RDWR | O_NONBLOCK, 0)) == -1)
+            throw c920_exception_t("cannot open device %s", _c920_parameters.device_name);
+        _fd_serial++;
 
         /*****************************************************
         Check if device is V4L2 capable
         ******************************************************/
-        DEBUG("Querying V4L2 capabilities for device %s", c920_parameters.device_name);
+        DEBUG("Querying V4L2 capabilities for device %s", _c920_parameters.device_name);
         if (ioctl_ex(_fd, VIDIOC_QUERYCAP, &cap) == -1)
         {
-            if (errno == EINVAL) throw c920_exception_t("%s is not a valid V4L2 device", c920_parameters.device_name);
+            if (errno == EINVAL) throw c920_exception_t("%s is not a valid V4L2 device", _c920_parameters.device_name);
             else throw c920_exception_t("error in ioctl VIDIOC_QUERYCAP");
         }
 
         /*****************************************************
         Check if it is a streaming capture device
         ******************************************************/
-        DEBUG("Testing if device %s is a streaming capture device", c920_parameters.device_name);
+        DEBUG("Testing if device %s is a streaming capture device", _c920_parameters.device_name);
         if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE))
-            throw c920_exception_t("%s is not a capture device", c920_parameters.device_name);
+            throw c920_exception_t("%s is not a capture device", _c920_parameters.device_name);
         if (!(cap.capabilities & V4L2_CAP_STREAMING))
-            throw c920_exception_t("%s is not a streaming device", c920_parameters.device_name);
+            throw c920_exception_t("%s is not a streaming device", _c920_parameters.device_name);
 
         /*****************************************************
         Set crop rectangle
         ******************************************************/
-        DEBUG("Trying to set crop rectange for device %s", c920_parameters.device_name);
+        DEBUG("Trying to set crop rectange for device %s", _c920_parameters.device_name);
         cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         if (ioctl_ex(_fd, VIDIOC_CROPCAP, &cropcap) == 0)
         {
             crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
             crop.c = cropcap.defrect;
             if (ioctl_ex(_fd, VIDIOC_S_CROP, &crop) == -1)
-                DEBUG("W: Unable to set crop for device %s", c920_parameters.device_name);
+                DEBUG("W: Unable to set crop for device %s", _c920_parameters.device_name);
         }
-        else DEBUG("W: Unable to get crop capabilities for device %s", c920_parameters.device_name);
+        else DEBUG("W: Unable to get crop capabilities for device %s", _c920_parameters.device_name);
 
         /*****************************************************
         Setting video format to H264
         ******************************************************/
-        DEBUG("Setting video format to H.264 (w:%d, h:%d) for device %s", c920_parameters.width, c920_parameters.height, c920_parameters.device_name);
+        DEBUG("Setting video format to H.264 (w:%d, h:%d) for device %s", _c920_parameters.width, _c920_parameters.height, _c920_parameters.device_name);
         fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        fmt.fmt.pix.width = c920_parameters.width;
-        fmt.fmt.pix.height = c920_parameters.height;
-        if(c920_parameters.format==MJPEG) fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_MJPEG;
-        else if(c920_parameters.format==YUYV) fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
-        else if(c920_parameters.format==H264) fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_H264;
+        fmt.fmt.pix.width = _c920_parameters.width;
+        fmt.fmt.pix.height = _c920_parameters.height;
+        if(_c920_parameters.format==MJPEG) fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_MJPEG;
+        else if(_c920_parameters.format==YUYV) fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+        else if(_c920_parameters.format==H264) fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_H264;
         else throw c920_exception_t("invalid format specified");
         fmt.fmt.pix.field = V4L2_FIELD_INTERLACED;
         if (ioctl_ex(_fd, VIDIOC_S_FMT, &fmt) == -1)
             throw c920_exception_t("error in ioctl VIDIOC_S_FMT");
+        _width = fmt.fmt.pix.width;
+        _height = fmt.fmt.pix.height;
 
         /*****************************************************
         Get streaming parameters
         ******************************************************/
-        DEBUG("Getting video stream parameters for device %s", c920_parameters.device_name);
+        DEBUG("Getting video stream parameters for device %s", _c920_parameters.device_name);
         parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         if (ioctl_ex(_fd, VIDIOC_G_PARM, &parm) == -1)
-            throw c920_exception_t("unable to get stream parameters for %s", c920_parameters.device_name);
+            throw c920_exception_t("unable to get stream parameters for %s", _c920_parameters.device_name);
 
         /*****************************************************
         Set frame rate
         ******************************************************/
         DEBUG("Time per frame was: %d/%d", parm.parm.capture.timeperframe.numerator, parm.parm.capture.timeperframe.denominator);
         parm.parm.capture.timeperframe.numerator = 1;
-        parm.parm.capture.timeperframe.denominator = c920_parameters.fps;
+        parm.parm.capture.timeperframe.denominator = _c920_parameters.fps;
         DEBUG("Time per frame set: %d/%d", parm.parm.capture.timeperframe.numerator, parm.parm.capture.timeperframe.denominator);
         if (ioctl_ex(_fd, VIDIOC_S_PARM, &parm) == -1)
-            throw c920_exception_t("unable to set stream parameters for %s", c920_parameters.device_name);
+            throw c920_exception_t("unable to set stream parameters for %s", _c920_parameters.device_name);
         DEBUG("Time per frame now: %d/%d", parm.parm.capture.timeperframe.numerator, parm.parm.capture.timeperframe.denominator);
 
         /*****************************************************
         Initialize MMAP (http://linuxtv.org/downloads/v4l-dvb-apis/mmap.html)
         ******************************************************/
-        DEBUG("Initializing MMAP for device %s", c920_parameters.device_name);
+        DEBUG("Initializing MMAP for device %s", _c920_parameters.device_name);
         req.count = 4;
         req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         req.memory = V4L2_MEMORY_MMAP;
         if (ioctl_ex(_fd,VIDIOC_REQBUFS, &req) == -1)
         {
-            if (errno == EINVAL) throw c920_exception_t("%s does not support MMAP", c920_parameters.device_name);
+            if (errno == EINVAL) throw c920_exception_t("%s does not support MMAP", _c920_parameters.device_name);
             else throw c920_exception_t("error in ioctl VIDIOC_REQBUFS");
         }
-        DEBUG("Device %s can handle %d memory mapped buffers", c920_parameters.device_name, req.count);
-        if (req.count < 2) throw c920_exception_t("insufficient memory on device %s", c920_parameters.device_name);
+        DEBUG("Device %s can handle %d memory mapped buffers", _c920_parameters.device_name, req.count);
+        if (req.count < 2) throw c920_exception_t("insufficient memory on device %s", _c920_parameters.device_name);
 
         /*****************************************************
         Allocate buffers to map
@@ -249,7 +484,7 @@ class c920_device_t
         /*****************************************************
         Queue buffers for device
         ******************************************************/
-        DEBUG("Queueing %d buffers for device %s", _num_buffers, c920_parameters.device_name);
+        DEBUG("Queueing %d buffers for device %s", _num_buffers, _c920_parameters.device_name);
         for (size_t i=0; i<_num_buffers; i++)
         {
             struct v4l2_buffer buf = {0};
@@ -261,25 +496,11 @@ class c920_device_t
             if (ioctl_ex(_fd, VIDIOC_QBUF, &buf) == -1)
                 throw c920_exception_t("error in ioctl VIDIOC_QBUF");
         }
-
-        /*****************************************************
-        Copy the device name so we can use it in error messages and set callback
-        ******************************************************/
-        _device_name = (char*) malloc(strlen(c920_parameters.device_name)+1);
-        strcpy(_device_name, c920_parameters.device_name);
-        DEBUG("Done with setup of device %s", c920_parameters.device_name);
-
-
     }
 
-    //Destructor
-    public: ~c920_device_t()
+    //Unmap buffers and close the device, never throws so it is safe in the destructor and during recovery
+    private: void close_device()
     {
-        /*****************************************************
-        Stop device playback
-        ******************************************************/
-        if (_playing) stop();
-
         /*****************************************************
         Destroy all buffers
         ******************************************************/
@@ -288,17 +509,20 @@ class c920_device_t
         {
             DEBUG("Unmapping buffer %d", i);
             if (munmap(_buffers[i].data, _buffers[i].length) == -1)
-                throw c920_exception_t("Unable to unmap buffer %d", i);
+                DEBUG("W: Unable to unmap buffer %d (%s)", i, strerror(errno));
         }
+        if (_buffers) free(_buffers);
+        _buffers = 0;
+        _num_buffers = 0;
 
         /*****************************************************
         Closing devices
         ******************************************************/
+        if (_fd == -1) return;
         DEBUG("Closing device %s", _device_name);
         if (close(_fd) == -1)
-            throw c920_exception_t("Unable to close device %s", _device_name);
-        if (_device_name) free(_device_name);
-        fclose((FILE*)_c920_parameters.pipe);
+            DEBUG("W: Unable to close device %s (%s)", _device_name, strerror(errno));
+        _fd = -1;
     }
 
     //Stop the capture device
@@ -307,6 +531,13 @@ class c920_device_t
         if (!_playing) return;
         _playing = false;
 
+        //Stopped halfway through a reopen, there is no stream to turn off
+        if (_reopening)
+        {
+            _reopening = false;
+            return;
+        }
+
         DEBUG("Stopping device %s", _device_name);
         enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         if (ioctl_ex(_fd, VIDIOC_STREAMOFF, &type) == -1)
@@ -328,6 +559,9 @@ class c920_device_t
                 throw c920_exception_t("error in ioctl VIDIOC_QBUF");
        }
 
+        //Every buffer is queued again, frames still held from before are stale
+        _generation++;
+        _leased = 0;
     }
 
     //Start the capture device
@@ -340,6 +574,7 @@ class c920_device_t
         enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         if (ioctl_ex(_fd, VIDIOC_STREAMON, &type) == -1)
             throw c920_exception_t("error in ioctl VIDIOC_STREAMON");
+        _recovered_us = now_us();
 
         set_bitrate(_c920_parameters.bitrate);
     }
@@ -347,13 +582,26 @@ class c920_device_t
     //Process a single frame from the capture stream, call this in a loop
     public: int process()
     {
+        //Blocking mode waits out the reopen backoff here, the pull API leaves that to check_stall()
+        if (_reopening)
+        {
+            long long wait_us = _reopen_at_us - now_us();
+            if (wait_us > 0) usleep(wait_us);
+            reopen_step();
+            return 1;
+        }
+
         fd_set fds;
         FD_ZERO(&fds);
         FD_SET(_fd, &fds);
 
+        //Supervised mode waits a few frame intervals instead of 2 seconds
+        long timeout_us = 2000000;
+        if (supervised()) timeout_us = wait_timeout_us();
+
         timeval tv;
-        tv.tv_sec = 2;
-        tv.tv_usec = 0;
+        tv.tv_sec = timeout_us / 1000000;
+        tv.tv_usec = timeout_us % 1000000;
 
         //Select the device
         switch (select(_fd+1, &fds, NULL, NULL, &tv))
@@ -361,15 +609,78 @@ class c920_device_t
             case -1:
             {
                 if (errno == EINTR) return 1;
+                else if (supervised()) { _recovery.errors++; recover(); return 1; }
                 else throw c920_exception_t("Could not select device %s", _device_name);
             }
             case 0:
             {
-                throw c920_exception_t("timeout occurred while selecting device %s", _device_name);
+                if (!supervised()) throw c920_exception_t("timeout occurred while selecting device %s", _device_name);
+                DEBUG("W: device %s stalled for %ldms", _device_name, timeout_us / 1000);
+                _recovery.stalls++;
+                recover();
+                return 1;
             }
         }
 
         //Dequeue a buffer
+        c920_frame_t frame;
+        if (!dequeue(frame)) return 1;
+
+        int r = 0;
+        if (_c920_parameters.cb) r = _c920_parameters.cb(frame.data, frame.length, _c920_parameters);
+
+        //Queue the buffer again
+        release(frame);
+
+        return r;
+    }
+
+    //V4L2 buffer timestamp of the frame the process() callback is handling, 0 if the driver sets none
+    public: long long timestamp_us() const { return _timestamp_us; }
+
+    //File descriptor of the device, readable when a frame can be dequeued. It is -1 while a
+    //recovery reopens the device and a new descriptor afterwards, see fd_serial()
+    public: int fd() const { return _fd; }
+
+    /*****************************************************
+    Changes whenever fd() is replaced by a new open. The new descriptor usually
+    gets the same number as the closed one, and closing it already removed it
+    from epoll sets, so event loops must re-register on a change of this
+    serial, not of the fd number.
+    ******************************************************/
+    public: unsigned long fd_serial() const { return _fd_serial; }
+
+    //Number of buffers mapped from the driver
+    public: size_t num_buffers() const { return _num_buffers; }
+
+    //Size of the largest mapped buffer, an upper bound for frame length
+    public: size_t buffer_size() const
+    {
+        size_t n = 0;
+        for (size_t i=0; i<_num_buffers; i++) if (_buffers[i].length > n) n = _buffers[i].length;
+        return n;
+    }
+
+    //Encoder bitrates as read back after set_bitrate, 0 if the camera did not report them
+    public: long average_bitrate() const { return _average_bitrate; }
+    public: long peak_bitrate() const { return _peak_bitrate; }
+
+    //Frame size the driver settled on, which can differ from the one requested
+    public: size_t width() const { return _width; }
+    public: size_t height() const { return _height; }
+
+    //Frame format requested from the device (YUYV, MJPEG or H264)
+    public: int format() const { return _c920_parameters.format; }
+
+    /*****************************************************
+    Dequeue a filled buffer without waiting. Returns false if no frame is
+    ready (or it was dropped while resyncing after a recovery). The frame
+    points into the mapped buffer and stays valid until release().
+    ******************************************************/
+    public: bool dequeue(c920_frame_t& frame)
+    {
+        if (_reopening) return false;
+
         v4l2_buffer buffer = {0};
         CLEAR(buffer);
         buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -377,23 +688,420 @@ class c920_device_t
 
         if (ioctl_ex(_fd, VIDIOC_DQBUF, &buffer) == -1)
         {
-            if (errno == EAGAIN){
-                DEBUG("errno == EAGAIN %s",_device_name);
-                return 1;
+            //Nothing ready is the normal case for a non-blocking fd, not worth a message
+            if (errno == EAGAIN) return false;
+            else if (supervised())
+            {
+                DEBUG("W: error in ioctl VIDIOC_DQBUF for device %s (%s)", _device_name, strerror(errno));
+                _recovery.errors++;
+                recover();
+                return false;
             }
             else throw c920_exception_t("error in ioctl VIDIOC_DQBUF");
         }
 
         assert(buffer.index < _num_buffers);
+        sample_latency(buffer);
+        _resets = 0;
+
+        frame.data = _buffers[buffer.index].data;
+        frame.length = buffer.bytesused;
+        frame.index = buffer.index;
+        frame.sequence = buffer.sequence;
+        frame.flags = buffer.flags;
+        frame.timestamp_us = (long long)buffer.timestamp.tv_sec * 1000000LL + buffer.timestamp.tv_usec;
+        frame.generation = _generation;
+
+        //After a recovery hold output back until the next IDR so the stream stays decodable
+        if (_resync)
+        {
+            if (_c920_parameters.format == H264 && !h264_has_idr((unsigned char*)frame.data, frame.length))
+            {
+                _recovery.dropped++;
+                release(frame);
+                return false;
+            }
+            resumed();
+        }
+        if (supervised()) _last_frame_us = now_us();
+        _timestamp_us = frame.timestamp_us;
+        return true;
+    }
 
-        int r = 0;
-        if (_c920_parameters.cb) r = _c920_parameters.cb(_buffers[buffer.index].data, buffer.bytesused, _c920_parameters);
+    //Give a dequeued frame back to the driver. Frames from before a recovery are already queued and ignored.
+    public: void release(const c920_frame_t& frame)
+    {
+        if (frame.generation != _generation) return;
+
+        v4l2_buffer buffer = {0};
+        CLEAR(buffer);
+        buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buffer.memory = V4L2_MEMORY_MMAP;
+        buffer.index = frame.index;
 
-        //Queue the buffer again
         if (ioctl_ex(_fd, VIDIOC_QBUF, &buffer) == -1)
-            throw c920_exception_t("error in ioctl VIDIOC_QBUF");
+        {
+            if (!supervised()) throw c920_exception_t("error in ioctl VIDIOC_QBUF");
+            _recovery.errors++;
+            recover();
+        }
+    }
 
-        return r;
+    /*****************************************************
+    Pull API for external event loops: watch fd() for readability (epoll,
+    libuv, asio...) and call try_dequeue() until it returns PULL_WOULD_BLOCK.
+    Nothing here waits. In supervised mode the loop calls check_stall() from
+    its own timer, every stall interval or so (100ms is fine): a recovery that
+    has to reopen the device makes one attempt per call once its backoff has
+    passed, and try_dequeue() returns PULL_REOPENING until it is back.
+    ******************************************************/
+    public: int try_dequeue(c920_lease_t& lease)
+    {
+        lease.release();
+        if (_reopening) return PULL_REOPENING;
+        if (!dequeue(lease._frame)) return PULL_WOULD_BLOCK;
+        lease._device = this;
+        _leased++;
+        return PULL_FRAME;
+    }
+
+    //Number of leases not yet released
+    public: size_t leased() const { return _leased; }
+
+    //True if a frame is older than the last recovery or stop()
+    public: bool stale(const c920_frame_t& frame) const { return frame.generation != _generation; }
+
+    //Recover if no frame arrived for stall_frames intervals, true if a recovery was started or advanced
+    public: bool check_stall()
+    {
+        if (!supervised() || !_playing) return false;
+        if (_reopening)
+        {
+            if (now_us() < _reopen_at_us) return false;
+            reopen_step();
+            return true;
+        }
+        long long now = now_us();
+
+        //Measure from the last frame, or from the last (re)start while waiting for the first one
+        long long since = _last_frame_us > _recovered_us ? _last_frame_us : _recovered_us;
+        if (now - since < wait_timeout_us()) return false;
+
+        DEBUG("W: device %s stalled for %ldms", _device_name, (long)((now - since) / 1000));
+        _recovery.stalls++;
+        recover();
+        return true;
+    }
+
+    //Recovery counters and downtime so far
+    public: const c920_recovery_t& recovery() const { return _recovery; }
+
+    //True if stall_frames asks for stall detection and recovery
+    public: bool supervised() const { return _c920_parameters.stall_frames > 0; }
+
+    //Stall threshold as a multiple of the frame interval
+    private: long stall_timeout_us() const
+    {
+        size_t fps = _c920_parameters.fps ? _c920_parameters.fps : 30;
+        return (long)_c920_parameters.stall_frames * 1000000L / (long)fps;
+    }
+
+    //Stall timeout for the next wait, longer while the first frame after a (re)start is due
+    public: long wait_timeout_us() const
+    {
+        long timeout_us = stall_timeout_us();
+        bool first = _resync || !_last_frame_us;
+        if (first && timeout_us < FIRST_FRAME_TIMEOUT_US) timeout_us = FIRST_FRAME_TIMEOUT_US;
+        return timeout_us;
+    }
+
+    /*****************************************************
+    Bring a stalled or failed stream back. A STREAMOFF/STREAMON cycle is tried
+    first; if that fails, or MAX_RESETS cycles in a row brought no frame (the
+    device takes STREAMON but stays wedged), the device is closed and reopened
+    by reopen_step() with a growing backoff until it comes back. Nothing in
+    here waits. Output resumes at the next IDR (see dequeue()).
+    ******************************************************/
+    private: void recover()
+    {
+        if (!_last_frame_us) _last_frame_us = now_us();
+        DEBUG("Recovering device %s", _device_name);
+
+        //Every buffer is requeued or unmapped from here on, frames still held are stale
+        _generation++;
+        _leased = 0;
+
+        if (_resets < MAX_RESETS && reset_stream())
+        {
+            _recovery.resets++;
+            _resets++;
+            restarted();
+            return;
+        }
+
+        close_device();
+        _reopening = true;
+        _reopen_attempts = 0;
+        _reopen_at_us = now_us();
+        reopen_step();
+    }
+
+    //One attempt to reopen the device, schedules the next one on failure
+    private: bool reopen_step()
+    {
+        try
+        {
+            open_device();
+            if (reset_stream())
+            {
+                _reopening = false;
+                _recovery.reopens++;
+                _resets = 0;
+                restarted();
+                return true;
+            }
+        }
+        catch (c920_exception_t &e)
+        {
+            DEBUG("W: reopen of device %s failed: %s", _device_name, e.message());
+        }
+        close_device();
+
+        long backoff_ms = _reopen_attempts < 5 ? 100L << _reopen_attempts : 2000;
+        _reopen_attempts++;
+        _reopen_at_us = now_us() + backoff_ms * 1000;
+        return false;
+    }
+
+    //The stream runs again, ask for an IDR and hold output back until it arrives
+    private: void restarted()
+    {
+        request_idr();
+        _resync = true;
+        _recovered_us = now_us();
+    }
+
+    //STREAMOFF, requeue every buffer and STREAMON again, false if the device refused
+    private: bool reset_stream()
+    {
+        enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        if (ioctl_ex(_fd, VIDIOC_STREAMOFF, &type) == -1)
+            DEBUG("W: error in ioctl VIDIOC_STREAMOFF for device %s", _device_name);
+
+        for (size_t i=0; i<_num_buffers; i++)
+        {
+            struct v4l2_buffer buf = {0};
+            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            buf.memory = V4L2_MEMORY_MMAP;
+            buf.index = i;
+            if (ioctl_ex(_fd, VIDIOC_QBUF, &buf) == -1) return false;
+        }
+
+        if (ioctl_ex(_fd, VIDIOC_STREAMON, &type) == -1) return false;
+        _playing = true;
+        set_bitrate(_c920_parameters.bitrate);
+        return true;
+    }
+
+    //First frame delivered after a recovery, account the downtime
+    private: void resumed()
+    {
+        _resync = false;
+        long downtime_ms = (long)((now_us() - _last_frame_us) / 1000);
+        _recovery.last_downtime_ms = downtime_ms;
+        _recovery.total_downtime_ms += downtime_ms;
+        if (downtime_ms > _recovery.max_downtime_ms) _recovery.max_downtime_ms = downtime_ms;
+        DEBUG("Device %s resumed after %ldms downtime (stalls:%lu errors:%lu resets:%lu reopens:%lu dropped:%lu)",
+            _device_name, downtime_ms, _recovery.stalls, _recovery.errors, _recovery.resets,
+            _recovery.reopens, _recovery.dropped);
+    }
+
+    //Ask the encoder for an IDR right away instead of waiting for the end of the GOP
+    private: void request_idr()
+    {
+        if (_c920_parameters.format != H264) return;
+        struct uvc_xu_control_query ctrl;
+        uvcx_picture_type_control_t pic;
+        pic.wLayerID = 0;
+        pic.wPicType = PICTURE_TYPE_IDR;
+        ctrl.unit = 12;
+        ctrl.size = sizeof(pic);
+        ctrl.selector = UVCX_PICTURE_TYPE_CONTROL;
+        ctrl.data = (unsigned char*)&pic;
+        ctrl.query = UVC_SET_CUR;
+        if (ioctl_ex(_fd, UVCIOC_CTRL_QUERY, &ctrl))
+            DEBUG("W: unable to request IDR from device %s", _device_name);
+    }
+
+    //True if the Annex-B buffer carries an IDR slice
+    public: static bool h264_has_idr(const unsigned char* p, size_t n)
+    {
+        const unsigned char* end = p + n;
+        for (const unsigned char* sc = c920_find_start_code(p, end); end - sc > 3; sc = c920_find_start_code(sc + 3, end))
+        {
+            if ((sc[3] & 0x1f) == NAL_IDR) return true;
+        }
+        return false;
+    }
+
+    private: static long long now_us()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    }
+
+    //Delay from the buffer timestamp to the dequeue measured so far, see sample_latency()
+    public: const c920_latency_t& latency() const { return _latency; }
+
+    //True if the latency includes the transfer of the frame and not just the wakeup
+    public: bool latency_includes_transfer() const { return _latency_sof; }
+
+    /*****************************************************
+    Run the capture loop on a dedicated thread pinned to params.cpu with
+    SCHED_FIFO params.priority. The capture and output buffers are prefaulted
+    and locked. If SCHED_FIFO is refused (EPERM) the thread stays pinned on the
+    normal scheduler; if the pinning is refused too a normal thread is
+    started. Call join_thread() to wait for it.
+    ******************************************************/
+    public: void start_thread()
+    {
+        if (_threaded) return;
+        if (!_playing) start();
+
+        /*****************************************************
+        Lock only what the loop touches on every frame. mlockall() would also
+        pin everything else that is mapped, e.g. a DVR ring of gigabytes.
+        ******************************************************/
+        DEBUG("Locking capture buffers for device %s", _device_name);
+        prefault();
+        for (size_t i=0; i<_num_buffers; i++) lock_memory(_buffers[i].data, _buffers[i].length);
+        if (_output_buffer) lock_memory(_output_buffer, OUTPUT_BUFFER_SIZE);
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+
+        if (_c920_parameters.cpu >= 0)
+        {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(_c920_parameters.cpu, &cpus);
+            DEBUG("Pinning capture thread of device %s to cpu %d", _device_name, _c920_parameters.cpu);
+            if (pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus) != 0)
+                DEBUG("W: Unable to set affinity to cpu %d", _c920_parameters.cpu);
+        }
+
+        if (_c920_parameters.priority > 0)
+        {
+            sched_param sp;
+            CLEAR(sp);
+            sp.sched_priority = _c920_parameters.priority;
+            DEBUG("Setting SCHED_FIFO priority %d for device %s", sp.sched_priority, _device_name);
+            pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+            pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+            pthread_attr_setschedparam(&attr, &sp);
+        }
+
+        int res = pthread_create(&_thread, &attr, thread_main, this);
+
+        //Without CAP_SYS_NICE only the policy is refused, keep the pinning
+        if ((res == EPERM || res == EINVAL) && _c920_parameters.priority > 0)
+        {
+            DEBUG("W: SCHED_FIFO refused (%s), keeping the normal scheduler", strerror(res));
+            pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+            res = pthread_create(&_thread, &attr, thread_main, this);
+        }
+        pthread_attr_destroy(&attr);
+        if (res == EPERM || res == EINVAL)
+        {
+            DEBUG("W: Real-time thread refused (%s), falling back to a normal thread", strerror(res));
+            res = pthread_create(&_thread, NULL, thread_main, this);
+        }
+        if (res != 0)
+        {
+            errno = res;
+            throw c920_exception_t("unable to create capture thread for device %s", _device_name);
+        }
+        _threaded = true;
+    }
+
+    //Wait for the capture thread to finish, rethrows any error it raised
+    public: void join_thread()
+    {
+        if (!_threaded) return;
+        pthread_join(_thread, NULL);
+        _threaded = false;
+
+        DEBUG("%s for device %s: n=%lu min=%ldus avg=%ldus p99<%ldus max=%ldus",
+            _latency_sof ? "Frame latency (start of frame to dequeue, includes USB transfer)" : "Scheduling latency",
+            _device_name, _latency.samples, _latency.min_us, _latency.mean_us(),
+            _latency.percentile_us(0.99), _latency.max_us);
+
+        if (_thread_failed)
+        {
+            _thread_failed = false;
+            throw _thread_error;
+        }
+    }
+
+    private: static void* thread_main(void* arg)
+    {
+        c920_device_t* self = (c920_device_t*) arg;
+
+        //Prefault a chunk of stack so deep callbacks don't fault either
+        volatile char stack[64*1024];
+        memset((char*)stack, 0, sizeof(stack));
+
+        try
+        {
+            while (self->process());
+        }
+        catch (c920_exception_t &e)
+        {
+            self->_thread_error = e;
+            self->_thread_failed = true;
+        }
+        return NULL;
+    }
+
+    //mlock() a buffer the capture thread touches, failing only costs page faults
+    public: static bool lock_memory(const void* data, size_t length)
+    {
+        if (mlock(data, length) == 0) return true;
+        DEBUG("W: Unable to lock %d bytes (%s), continuing unlocked", length, strerror(errno));
+        return false;
+    }
+
+    //Touch every page of the capture buffers and give the output pipe a prefaulted buffer
+    private: void prefault()
+    {
+        long page = sysconf(_SC_PAGESIZE);
+        volatile char sink = 0;
+        for (size_t i=0; i<_num_buffers; i++)
+            for (size_t o=0; o<_buffers[i].length; o+=page)
+                sink = sink + ((volatile char*)_buffers[i].data)[o];
+
+        if (_c920_parameters.pipe && !_output_buffer)
+        {
+            _output_buffer = (char*) malloc(OUTPUT_BUFFER_SIZE);
+            if (!_output_buffer) throw c920_exception_t("out of memory");
+            memset(_output_buffer, 0, OUTPUT_BUFFER_SIZE);
+            if (setvbuf((FILE*)_c920_parameters.pipe, _output_buffer, _IOFBF, OUTPUT_BUFFER_SIZE) != 0)
+                DEBUG("W: Unable to set output buffer for device %s", _device_name);
+        }
+    }
+
+    //Record the delay between the buffer timestamp and now. Only a buffer stamped at
+    //the end of the frame gives the wakeup delay alone; UVC stamps the start of
+    //frame, which adds the USB transfer time of the frame and is reported as such.
+    private: void sample_latency(const v4l2_buffer& buffer)
+    {
+        if (buffer.timestamp.tv_sec == 0 && buffer.timestamp.tv_usec == 0) return;
+        if ((buffer.flags & V4L2_BUF_FLAG_TSTAMP_SRC_MASK) != V4L2_BUF_FLAG_TSTAMP_SRC_EOF) _latency_sof = true;
+        timespec now;
+        clock_gettime((buffer.flags & V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) ? CLOCK_MONOTONIC : CLOCK_REALTIME, &now);
+        long us = (now.tv_sec - buffer.timestamp.tv_sec) * 1000000L + now.tv_nsec / 1000 - buffer.timestamp.tv_usec;
+        _latency.add(us);
     }
 
     //Keep comm with device until done (http://man7.org/linux/man-pages/man2/ioctl.2.html)
@@ -411,9 +1119,10 @@ class c920_device_t
         int bmax = bmin;
         int res;
         struct uvc_xu_control_query ctrl;
-        uvcx_bitrate_layers_t  conf;
+        //uvcx_bitrate_layers_t as sent on the wire, the header struct is padded to 12 bytes
+        struct __attribute__((packed)) { WORD wLayerID; DWORD dwPeakBitrate; DWORD dwAverageBitrate; } conf;
         ctrl.unit = 12;
-        ctrl.size = 10;
+        ctrl.size = sizeof(conf);
         ctrl.selector = UVCX_BITRATE_LAYERS;
         ctrl.data = (unsigned char*)&conf;
         ctrl.query = UVC_GET_CUR;
@@ -446,14 +1155,30 @@ class c920_device_t
           return;
           //throw c920_exception_t("error in ioctl ctrl_query");
         }
+        _peak_bitrate = conf.dwPeakBitrate;
+        _average_bitrate = conf.dwAverageBitrate;
     }
 
 };
 
+inline bool c920_lease_t::stale() const
+{
+    return _device && _device->stale(_frame);
+}
+
+inline void c920_lease_t::release()
+{
+    if (!_device) return;
+    c920_device_t* device = _device;
+    _device = 0;
+    if (!device->stale(_frame) && device->_leased) device->_leased--;
+    device->release(_frame);
+}
+
 //Specify options list
 //./capture -W 1280 -H 720 -f IMAGE -d /dev/video0 -c 1 -p 1 -o stdout
 //./capture -W 1280 -H 720 -f VIDEO -d /dev/video0 -c 300 -p 30 -b 500000 -o stdout
-static const char short_options[] = "d:hmruW:H:I:f:t:T:p:c:o:l:b:";
+static const char short_options[] = "d:hmruW:H:I:f:t:T:p:c:o:l:b:A:P:S:x:n:iD:a:y:z:ej:";
 static const struct option
   long_options[] = {
     { "device",        required_argument, NULL, 'd'},
@@ -472,6 +1197,18 @@ static const struct option
     { "output",        required_argument, NULL, 'o'},
     { "directory",     required_argument, NULL, 'l'},
     { "bitrate",       required_argument, NULL, 'b'},
+    { "cpu",           required_argument, NULL, 'A'},
+    { "priority",      required_argument, NULL, 'P'},
+    { "stall",         required_argument, NULL, 'S'},
+    { "tee",           required_argument, NULL, 'x'},
+    { "nal",           required_argument, NULL, 'n'},
+    { "inject",        no_argument,       NULL, 'i'},
+    { "dvr",           required_argument, NULL, 'D'},
+    { "analyze",       required_argument, NULL, 'a'},
+    { "spike",         required_argument, NULL, 'y'},
+    { "scale",         required_argument, NULL, 'z'},
+    { "pull",          no_argument,       NULL, 'e'},
+    { "mjpeg",         required_argument, NULL, 'j'},
     { 0, 0, 0, 0}
 };
 void setParametersFromArgs(c920_parameters_t& params, int argc, char **argv){
@@ -516,6 +1253,44 @@ void setParametersFromArgs(c920_parameters_t& params, int argc, char **argv){
                 break;
             case 'b':
                 params.bitrate = atoi(optarg);
+                break;
+            case 'A': //Affinity (CPU for the capture thread)
+                params.cpu = atoi(optarg);
+                break;
+            case 'P': //Priority (SCHED_FIFO priority for the capture thread)
+                params.priority = atoi(optarg);
+                break;
+            case 'S': //Stall (Frame intervals before recovering the stream)
+                params.stall_frames = atoi(optarg);
+                break;
+            case 'x': //Tee (Additional sinks)
+                params.tee = optarg;
+                break;
+            case 'n': //NAL (H264 output framing)
+                if(strcmp("annexb",optarg)==0) params.nal=H264_ANNEXB;
+                if(strcmp("avcc",optarg)==0) params.nal=H264_AVCC;
+                break;
+            case 'i': //Inject (SPS/PPS before every IDR)
+                params.inject = 1;
+                break;
+            case 'D': //DVR (Circular recording file)
+                params.dvr = optarg;
+                break;
+            case 'a': //Analyze (H264 GOP and bitrate analysis)
+                params.analyze = optarg;
+                break;
+            case 'y': //Spike (Spike threshold for the analysis)
+                params.spike = atof(optarg);
+                break;
+            case 'z': //Scale (Downscaled and cropped YUYV outputs)
+                params.scale = optarg;
+                break;
+            case 'e': //Pull (epoll loop with the non-blocking pull API)
+                params.pull = 1;
+                break;
+            case 'j': //MJPEG (Frame validation and splitting)
+                params.mjpeg = optarg;
+                break;
         }
     }
 }
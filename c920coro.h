@@ -0,0 +1,64 @@
+#ifndef C920_CORO_H
+#define C920_CORO_H
+
+//Optional C++20 coroutine wrapper around the pull API, include only from C++20 code
+#if __cplusplus < 202002L
+#error "c920coro.h needs C++20 coroutines"
+#endif
+
+#include <coroutine>
+#include "c920capture.h"
+
+//Ask the event loop to resume handle once when fd becomes readable (one shot, e.g. EPOLLONESHOT)
+typedef void (*c920_watch_fn)(int fd, std::coroutine_handle<> handle, void* user);
+
+/*****************************************************
+co_await c920_next_frame(camera, lease, watch, loop) suspends until the
+device fd is readable and then tries to dequeue into the lease. It yields
+the try_dequeue() status: a wakeup can still find nothing to dequeue (a
+frame dropped while resyncing), so await it in a loop. While a recovery
+reopens the device there is no fd to watch: it does not suspend and yields
+PULL_REOPENING, wait on a timer of the event loop and call check_stall():
+    int s;
+    while ((s = co_await c920_next_frame(camera, lease, watch, loop)) != PULL_FRAME)
+        if (s == PULL_REOPENING) { co_await sleep_100ms(loop); camera.check_stall(); }
+The coroutine never suspends when a frame is already waiting.
+******************************************************/
+class c920_frame_awaitable_t
+{
+    private: c920_device_t& _device;
+    private: c920_lease_t& _lease;
+    private: c920_watch_fn _watch;
+    private: void* _user;
+    private: int _status;
+
+    public: c920_frame_awaitable_t(c920_device_t& device, c920_lease_t& lease, c920_watch_fn watch, void* user)
+        : _device(device), _lease(lease), _watch(watch), _user(user), _status(PULL_WOULD_BLOCK) {}
+
+    public: bool await_ready()
+    {
+        _status = _device.try_dequeue(_lease);
+        return _status != PULL_WOULD_BLOCK;
+    }
+
+    //Resume right away if the fd went away in between, nothing would ever wake us
+    public: bool await_suspend(std::coroutine_handle<> handle)
+    {
+        if (_device.fd() == -1) { _status = PULL_REOPENING; return false; }
+        _watch(_device.fd(), handle, _user);
+        return true;
+    }
+
+    public: int await_resume()
+    {
+        if (_status == PULL_WOULD_BLOCK) _status = _device.try_dequeue(_lease);
+        return _status;
+    }
+};
+
+inline c920_frame_awaitable_t c920_next_frame(c920_device_t& device, c920_lease_t& lease, c920_watch_fn watch, void* user)
+{
+    return c920_frame_awaitable_t(device, lease, watch, user);
+}
+
+#endif
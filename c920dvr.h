@@ -0,0 +1,438 @@
+#ifndef C920_DVR_H
+#define C920_DVR_H
+
+#include "c920capture.h"
+#include <stdint.h>
+#include <stddef.h>
+
+/*****************************************************
+Circular DVR file. One preallocated file is mapped and frames are written
+round robin into its data region, so disk usage is constant and nothing is
+created or deleted while recording.
+
+Layout:
+    [header 4096] [index ring, index_entries * 40] [data ring, data_size]
+
+Every frame gets an index entry (sequence number, logical position, wall
+clock timestamp, length, flags, CRC32C of the data, CRC32C of the entry).
+Positions are logical byte offsets that only grow; the physical offset is
+position % data_size and a frame never straddles the end of the ring. An
+entry is intact while newest_end - position <= data_size.
+
+Every commit_frames frames the dirty data and index ranges are msync'ed and
+one of two alternating commit slots in the header records the newest
+durable sequence. After a power loss the newest valid frame is found from
+the commit slot plus a short forward scan of the index, checking CRCs.
+******************************************************/
+
+#define C920_DVR_MAGIC "C920DVR1"
+
+const uint32_t DVR_FRAME_KEYFRAME = 0x1;
+
+struct c920_dvr_commit_t
+{
+    public: uint64_t seq;          //Newest durable frame, 0 if none
+    public: uint64_t end;          //Logical end of its data
+    public: uint32_t crc;
+    public: uint32_t reserved;
+};
+
+struct c920_dvr_header_t
+{
+    public: char magic[8];
+    public: uint32_t version;
+    public: uint32_t format;
+    public: uint32_t width;
+    public: uint32_t height;
+    public: uint64_t file_size;
+    public: uint64_t index_offset;
+    public: uint64_t index_entries;
+    public: uint64_t data_offset;
+    public: uint64_t data_size;
+    public: c920_dvr_commit_t commit[2];
+};
+
+struct c920_dvr_entry_t
+{
+    public: uint64_t seq;
+    public: uint64_t position;
+    public: int64_t timestamp_us;  //Wall clock (CLOCK_REALTIME) when the frame was written
+    public: uint32_t length;
+    public: uint32_t flags;
+    public: uint32_t data_crc;
+    public: uint32_t crc;
+};
+
+/*****************************************************
+CRC32C (Castagnoli), with the SSE4.2 instruction when the CPU has it
+******************************************************/
+class c920_crc32c_t
+{
+    private: static const uint32_t* table()
+    {
+        static uint32_t t[256];
+        static bool init = false;
+        if (!init)
+        {
+            for (uint32_t i=0; i<256; i++)
+            {
+                uint32_t c = i;
+                for (int k=0; k<8; k++) c = c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+                t[i] = c;
+            }
+            init = true;
+        }
+        return t;
+    }
+
+#if defined(__x86_64__)
+    private: __attribute__((target("sse4.2"))) static uint32_t hardware(uint32_t crc, const unsigned char* p, size_t n)
+    {
+        uint64_t c = crc;
+        for (; n >= 8; n -= 8, p += 8)
+        {
+            uint64_t v;
+            memcpy(&v, p, 8);
+            c = __builtin_ia32_crc32di(c, v);
+        }
+        crc = (uint32_t)c;
+        for (; n; n--, p++) crc = __builtin_ia32_crc32qi(crc, *p);
+        return crc;
+    }
+#endif
+
+    public: static uint32_t compute(const void* data, size_t n, uint32_t crc = 0)
+    {
+        const unsigned char* p = (const unsigned char*) data;
+        crc = ~crc;
+#if defined(__x86_64__)
+        static int sse42 = -1;
+        if (sse42 < 0) sse42 = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+        if (sse42) return ~hardware(crc, p, n);
+#endif
+        const uint32_t* t = table();
+        for (; n; n--, p++) crc = t[(crc ^ *p) & 0xff] ^ (crc >> 8);
+        return ~crc;
+    }
+};
+
+//Read side of a DVR file, also used by the writer to pick up where it left off
+class c920_dvr_reader_t
+{
+    protected: int _fd;
+    protected: unsigned char* _map;
+    protected: c920_dvr_header_t* _header;
+    protected: c920_dvr_entry_t* _index;
+    protected: unsigned char* _data;
+    protected: uint64_t _newest;       //Sequence of the newest valid frame, 0 if the ring is empty
+    protected: uint64_t _end;          //Logical end of the newest frame
+
+    protected: c920_dvr_reader_t() : _fd(-1), _map(0), _header(0), _index(0), _data(0), _newest(0), _end(0) {}
+
+    public: c920_dvr_reader_t(const char* path) : _fd(-1), _map(0), _header(0), _index(0), _data(0), _newest(0), _end(0)
+    {
+        struct stat st;
+        if ((_fd = open(path, O_RDONLY)) == -1)
+            throw c920_exception_t("cannot open DVR file %s", path);
+        if (fstat(_fd, &st) == -1 || (size_t)st.st_size < sizeof(c920_dvr_header_t))
+            throw c920_exception_t("%s is not a DVR file", path);
+        map(path, st.st_size, PROT_READ);
+        recover();
+    }
+
+    public: virtual ~c920_dvr_reader_t()
+    {
+        if (_map) munmap(_map, _header ? _header->file_size : 0);
+        if (_fd != -1) close(_fd);
+    }
+
+    public: const c920_dvr_header_t& header() const { return *_header; }
+    public: uint64_t newest() const { return _newest; }
+
+    //Oldest sequence whose data has not been overwritten yet
+    public: uint64_t oldest() const
+    {
+        if (!_newest) return 0;
+        uint64_t s = _newest;
+        while (s > 1 && intact(s - 1)) s--;
+        return s;
+    }
+
+    //Entry for a sequence number if it is still intact, NULL otherwise
+    public: const c920_dvr_entry_t* entry(uint64_t seq) const
+    {
+        return intact(seq) ? &_index[seq % _header->index_entries] : NULL;
+    }
+
+    public: const void* data(const c920_dvr_entry_t& e) const { return _data + e.position % _header->data_size; }
+
+    //True if the frame data still matches its checksum
+    public: bool verify(const c920_dvr_entry_t& e) const
+    {
+        return c920_crc32c_t::compute(data(e), e.length) == e.data_crc;
+    }
+
+    protected: void map(const char* path, size_t size, int prot)
+    {
+        void* m = mmap(NULL, size, prot, MAP_SHARED, _fd, 0);
+        if (m == MAP_FAILED) throw c920_exception_t("cannot map DVR file %s", path);
+        _map = (unsigned char*) m;
+        _header = (c920_dvr_header_t*) _map;
+
+        if (memcmp(_header->magic, C920_DVR_MAGIC, 8) != 0 || _header->file_size != size || !valid_layout(*_header))
+        {
+            munmap(_map, size);
+            _map = 0;
+            _header = 0;
+            throw c920_exception_t("%s is not a DVR file", path);
+        }
+        _index = (c920_dvr_entry_t*)(_map + _header->index_offset);
+        _data = _map + _header->data_offset;
+    }
+
+    //Header, index and data fit the file in that order and are not empty, without overflowing on damaged values
+    protected: static bool valid_layout(const c920_dvr_header_t& h)
+    {
+        if (!h.index_entries || !h.data_size) return false;
+        if (h.index_offset < sizeof(c920_dvr_header_t) || h.index_offset > h.data_offset) return false;
+        if (h.index_entries > (h.data_offset - h.index_offset) / sizeof(c920_dvr_entry_t)) return false;
+        return h.data_offset <= h.file_size && h.data_size <= h.file_size - h.data_offset;
+    }
+
+    protected: static uint32_t entry_crc(const c920_dvr_entry_t& e) { return c920_crc32c_t::compute(&e, offsetof(c920_dvr_entry_t, crc)); }
+    protected: static uint32_t commit_crc(const c920_dvr_commit_t& c) { return c920_crc32c_t::compute(&c, offsetof(c920_dvr_commit_t, crc)); }
+
+    //Entry for seq is in place, consistent and its data has not been overwritten by newer frames
+    protected: bool intact(uint64_t seq) const
+    {
+        if (!seq || seq > _newest) return false;
+        const c920_dvr_entry_t& e = _index[seq % _header->index_entries];
+        return e.seq == seq && e.crc == entry_crc(e) && _end - e.position <= _header->data_size;
+    }
+
+    //Start at the newest durable commit and walk forward while entries and data check out
+    protected: void recover()
+    {
+        const c920_dvr_commit_t* best = NULL;
+        for (int i=0; i<2; i++)
+        {
+            const c920_dvr_commit_t& c = _header->commit[i];
+            if (c.crc == commit_crc(c) && (!best || c.seq > best->seq)) best = &c;
+        }
+        _newest = best ? best->seq : 0;
+        _end = best ? best->end : 0;
+
+        for (;;)
+        {
+            uint64_t s = _newest + 1;
+            const c920_dvr_entry_t& e = _index[s % _header->index_entries];
+            if (e.seq != s || e.crc != entry_crc(e) || e.position < _end || e.length > _header->data_size) break;
+            if (e.position % _header->data_size + e.length > _header->data_size) break;
+            if (!verify(e)) break;
+            _newest = s;
+            _end = e.position + e.length;
+        }
+        DEBUG("DVR recovered up to frame %llu (committed %llu)", (unsigned long long)_newest,
+            (unsigned long long)(best ? best->seq : 0));
+    }
+};
+
+//Write side, see the layout description above
+class c920_dvr_t : public c920_dvr_reader_t
+{
+    public: static const size_t HEADER_SIZE = 4096;
+    public: static const size_t ALIGN = 64;
+
+    private: char* _path;
+    private: uint64_t _seq;
+    private: uint64_t _committed_seq;
+    private: uint64_t _committed_end;
+    private: unsigned int _commits;
+    private: int _commit_frames;
+    private: int _uncommitted;
+    private: size_t _page;
+
+    /*****************************************************
+    Open or create a ring of file_size bytes. An existing ring with the same
+    size, format and frame size is reused and continues after its newest
+    valid frame. Any other non-empty file, including a ring of another size
+    or format, holds a recording that would be lost: it is only recreated
+    with overwrite, otherwise this throws.
+    ******************************************************/
+    public: c920_dvr_t(const char* path, uint64_t file_size, uint64_t index_entries, int format, size_t width, size_t height, int commit_frames, bool overwrite)
+    {
+        _path = strdup(path);
+        _commit_frames = commit_frames > 0 ? commit_frames : 1;
+        _uncommitted = 0;
+        _commits = 0;
+        _page = sysconf(_SC_PAGESIZE);
+
+        struct stat st;
+        bool found = stat(path, &st) == 0 && st.st_size > 0;
+        bool existing = found && (uint64_t)st.st_size == file_size;
+
+        DEBUG("Opening DVR file %s (%llu bytes)", path, (unsigned long long)file_size);
+        if ((_fd = open(path, O_RDWR | O_CREAT, 0644)) == -1)
+            throw c920_exception_t("cannot open DVR file %s", path);
+
+        if (existing)
+        {
+            try
+            {
+                map(path, file_size, PROT_READ | PROT_WRITE);
+                if (_header->format != (uint32_t)format || _header->width != width || _header->height != height)
+                    throw c920_exception_t("DVR file %s holds format %d at %dx%d", path, (int)_header->format,
+                        (int)_header->width, (int)_header->height);
+                recover();
+            }
+            catch (c920_exception_t &e)
+            {
+                if (!overwrite)
+                {
+                    free(_path);
+                    _path = 0;
+                    throw c920_exception_t("%s, refusing to overwrite it", e.message());
+                }
+                DEBUG("W: %s, overwriting it", e.message());
+                existing = false;
+            }
+        }
+        else if (found)
+        {
+            if (!overwrite)
+            {
+                free(_path);
+                _path = 0;
+                throw c920_exception_t("DVR file %s has %lld bytes, not %llu, refusing to overwrite it", path,
+                    (long long)st.st_size, (unsigned long long)file_size);
+            }
+            DEBUG("W: DVR file %s has %lld bytes, overwriting it", path, (long long)st.st_size);
+        }
+
+        if (!existing) create(path, file_size, index_entries, format, width, height);
+
+        _seq = _newest;
+        _committed_seq = _newest;
+        _committed_end = _end;
+    }
+
+    public: ~c920_dvr_t()
+    {
+        if (_map) commit();
+        free(_path);
+    }
+
+    //Append a frame, overwriting the oldest ones. Blocks in msync every commit_frames frames.
+    public: void write(const void* data, size_t length, int64_t timestamp_us, bool keyframe)
+    {
+        uint64_t ds = _header->data_size;
+        if (length > ds) throw c920_exception_t("frame of %d bytes does not fit DVR ring of %llu bytes", length, (unsigned long long)ds);
+
+        uint64_t pos = (_end + ALIGN - 1) / ALIGN * ALIGN;
+        if (pos % ds + length > ds) pos += ds - pos % ds;
+        memcpy(_data + pos % ds, data, length);
+
+        c920_dvr_entry_t e;
+        CLEAR(e);
+        e.seq = ++_seq;
+        e.position = pos;
+        e.timestamp_us = timestamp_us;
+        e.length = length;
+        e.flags = keyframe ? DVR_FRAME_KEYFRAME : 0;
+        e.data_crc = c920_crc32c_t::compute(data, length);
+        e.crc = entry_crc(e);
+        _index[e.seq % _header->index_entries] = e;
+
+        _newest = e.seq;
+        _end = pos + length;
+        if (++_uncommitted >= _commit_frames) commit();
+    }
+
+    //Flush everything written since the last commit and advance the commit slot
+    public: void commit()
+    {
+        if (_seq == _committed_seq) return;
+        uint64_t ds = _header->data_size;
+
+        //Data written since the last commit, split where the ring wraps
+        if (_end - _committed_end >= ds) sync(_data, ds);
+        else
+        {
+            uint64_t a = _committed_end % ds, b = _end % ds;
+            if (b > a || _end == _committed_end) sync(_data + a, b - a);
+            else { sync(_data + a, ds - a); sync(_data, b); }
+        }
+
+        //Index slots since the last commit
+        uint64_t n = _header->index_entries;
+        if (_seq - _committed_seq >= n) sync(_index, n * sizeof(c920_dvr_entry_t));
+        else
+        {
+            uint64_t a = (_committed_seq + 1) % n, b = _seq % n;
+            if (b >= a) sync(_index + a, (b - a + 1) * sizeof(c920_dvr_entry_t));
+            else { sync(_index + a, (n - a) * sizeof(c920_dvr_entry_t)); sync(_index, (b + 1) * sizeof(c920_dvr_entry_t)); }
+        }
+
+        c920_dvr_commit_t& c = _header->commit[_commits++ & 1];
+        c.seq = _seq;
+        c.end = _end;
+        c.reserved = 0;
+        c.crc = commit_crc(c);
+        sync(_header, sizeof(c920_dvr_header_t));
+
+        _committed_seq = _seq;
+        _committed_end = _end;
+        _uncommitted = 0;
+    }
+
+    private: void create(const char* path, uint64_t file_size, uint64_t index_entries, int format, size_t width, size_t height)
+    {
+        if (_map) { munmap(_map, _header->file_size); _map = 0; _header = 0; }
+        if (!index_entries) index_entries = 1024;
+
+        uint64_t index_offset = HEADER_SIZE;
+        uint64_t data_offset = (index_offset + index_entries * sizeof(c920_dvr_entry_t) + _page - 1) / _page * _page;
+        if (data_offset + ALIGN >= file_size) throw c920_exception_t("DVR file %s is too small", path);
+
+        DEBUG("Preallocating DVR file %s with %llu index entries", path, (unsigned long long)index_entries);
+        if (ftruncate(_fd, 0) == -1 || ftruncate(_fd, file_size) == -1)
+            throw c920_exception_t("cannot size DVR file %s", path);
+        int res = posix_fallocate(_fd, 0, file_size);
+        if (res != 0 && res != EOPNOTSUPP && res != EINVAL)
+        {
+            errno = res;
+            throw c920_exception_t("cannot preallocate DVR file %s", path);
+        }
+
+        c920_dvr_header_t h;
+        CLEAR(h);
+        memcpy(h.magic, C920_DVR_MAGIC, 8);
+        h.version = 1;
+        h.format = format;
+        h.width = width;
+        h.height = height;
+        h.file_size = file_size;
+        h.index_offset = index_offset;
+        h.index_entries = index_entries;
+        h.data_offset = data_offset;
+        h.data_size = (file_size - data_offset) / ALIGN * ALIGN;
+        if (pwrite(_fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h))
+            throw c920_exception_t("cannot write DVR header to %s", path);
+
+        map(path, file_size, PROT_READ | PROT_WRITE);
+        _newest = 0;
+        _end = 0;
+    }
+
+    //msync a range, widened to whole pages
+    private: void sync(const void* p, size_t n)
+    {
+        if (!n) return;
+        uintptr_t a = (uintptr_t)p / _page * _page;
+        uintptr_t b = (uintptr_t)p + n;
+        if (msync((void*)a, b - a, MS_SYNC) == -1)
+            DEBUG("W: msync of DVR file %s failed (%s)", _path, strerror(errno));
+    }
+};
+
+#endif
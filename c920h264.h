@@ -0,0 +1,577 @@
+#ifndef C920_H264_H
+#define C920_H264_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+//NAL unit types
+const int NAL_SLICE = 1;
+const int NAL_IDR = 5;
+const int NAL_SEI = 6;
+const int NAL_SPS = 7;
+const int NAL_PPS = 8;
+const int NAL_AUD = 9;
+
+//Rewriter output formats
+const int H264_ANNEXB = 0;    //00 00 00 01 start codes
+const int H264_AVCC = 1;      //4 byte big endian NAL lengths
+
+/*****************************************************
+Find the next 00 00 01 start code in [p, end), returns end if there is none.
+With SSE2 16 positions are tested per iteration by comparing three shifted
+loads, the tail is finished byte by byte.
+******************************************************/
+static inline const unsigned char* c920_find_start_code(const unsigned char* p, const unsigned char* end)
+{
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    while (end - p >= 18)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)p);
+        __m128i b = _mm_loadu_si128((const __m128i*)(p + 1));
+        __m128i c = _mm_loadu_si128((const __m128i*)(p + 2));
+        __m128i m = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(a, zero), _mm_cmpeq_epi8(b, zero)), _mm_cmpeq_epi8(c, one));
+        int mask = _mm_movemask_epi8(m);
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    for (; end - p >= 3; p++)
+    {
+        if (p[0] == 0 && p[1] == 0 && p[2] == 1) return p;
+    }
+    return end;
+}
+
+//A NAL unit inside an Annex-B buffer, without start code and trailing zero bytes
+struct c920_nal_t
+{
+    public: const unsigned char* data;
+    public: size_t length;
+    public: int type;
+};
+
+//Walks the NAL units of an Annex-B buffer without copying
+class c920_nal_reader_t
+{
+    private: const unsigned char* _next;
+    private: const unsigned char* _end;
+
+    public: c920_nal_reader_t(const void* data, size_t length)
+    {
+        _end = (const unsigned char*)data + length;
+        _next = c920_find_start_code((const unsigned char*)data, _end);
+    }
+
+    public: bool next(c920_nal_t& nal)
+    {
+        while (_next < _end)
+        {
+            const unsigned char* start = _next + 3;
+            _next = c920_find_start_code(start, _end);
+
+            //Zero bytes before the next start code are trailing_zero_8bits or the first byte of a 4 byte start code
+            const unsigned char* stop = _next;
+            while (stop > start && stop[-1] == 0) stop--;
+            if (stop == start) continue;
+
+            nal.data = start;
+            nal.length = stop - start;
+            nal.type = start[0] & 0x1f;
+            return true;
+        }
+        return false;
+    }
+};
+
+/*****************************************************
+Rewrites H264 access units as they come out of the camera: keeps the latest
+SPS/PPS, optionally puts them in front of every IDR that arrives without them
+and emits Annex-B or AVCC. All memory is allocated up front; Annex-B output
+is passed through untouched unless parameter sets are actually injected.
+******************************************************/
+class c920_h264_rewriter_t
+{
+    public: static const size_t MAX_PARAMETER_SET = 256;
+
+    private: unsigned char _sps[MAX_PARAMETER_SET];
+    private: size_t _sps_length;
+    private: unsigned char _pps[MAX_PARAMETER_SET];
+    private: size_t _pps_length;
+    private: unsigned char* _out;
+    private: size_t _capacity;
+    private: int _output;
+    private: bool _inject;
+    private: unsigned long _injected;
+
+    //max_frame is the largest access unit that will be rewritten, usually c920_device_t::buffer_size()
+    public: c920_h264_rewriter_t(size_t max_frame, int output, bool inject)
+    {
+        _sps_length = 0;
+        _pps_length = 0;
+        _output = output;
+        _inject = inject;
+        _injected = 0;
+
+        _capacity = output_size(max_frame);
+        _out = (unsigned char*) malloc(_capacity);
+    }
+
+    public: ~c920_h264_rewriter_t() { free(_out); }
+
+    //Largest rewritten access unit, a 3 byte start code in front of a 1 byte NAL grows by a quarter in the worst case
+    public: static size_t output_size(size_t max_frame)
+    {
+        return max_frame + max_frame / 4 + 2 * (MAX_PARAMETER_SET + 4) + 16;
+    }
+
+    //False if the scratch buffer could not be allocated
+    public: bool valid() const { return _out != NULL; }
+
+    public: unsigned long injected() const { return _injected; }
+    public: bool has_parameter_sets() const { return _sps_length && _pps_length; }
+    public: const unsigned char* sps(size_t& length) const { length = _sps_length; return _sps; }
+    public: const unsigned char* pps(size_t& length) const { length = _pps_length; return _pps; }
+
+    /*****************************************************
+    Rewrite one access unit. out points either to the input or to the
+    rewriter's buffer, which stays valid until the next call. Returns false
+    if the result would not fit the buffer, out is then left untouched.
+    ******************************************************/
+    public: bool rewrite(const void* data, size_t length, const void*& out, size_t& out_length)
+    {
+        if (_output == H264_ANNEXB) return splice(data, length, out, out_length);
+        if (!_out) return false;
+
+        size_t n = 0;
+        bool has_sps = false, has_pps = false, idr_seen = false;
+        c920_nal_reader_t reader(data, length);
+        c920_nal_t nal;
+        while (reader.next(nal))
+        {
+            cache(nal);
+            if (nal.type == NAL_SPS) has_sps = true;
+            if (nal.type == NAL_PPS) has_pps = true;
+
+            if (nal.type == NAL_IDR && !idr_seen)
+            {
+                idr_seen = true;
+                if (_inject && (!has_sps || !has_pps) && has_parameter_sets())
+                {
+                    if (!emit(n, _sps, _sps_length) || !emit(n, _pps, _pps_length)) return false;
+                    _injected++;
+                }
+            }
+
+            if (!emit(n, nal.data, nal.length)) return false;
+        }
+
+        out = _out;
+        out_length = n;
+        return true;
+    }
+
+    /*****************************************************
+    Write the AVCDecoderConfigurationRecord (avcC box payload) for the cached
+    parameter sets, as muxers need it for AVCC streams. Returns its size, or 0
+    if no SPS/PPS has been seen yet or the buffer is too small.
+    ******************************************************/
+    public: size_t avcc_config(unsigned char* buf, size_t size) const
+    {
+        size_t need = 11 + _sps_length + _pps_length;
+        if (!has_parameter_sets() || _sps_length < 4 || size < need) return 0;
+
+        size_t n = 0;
+        buf[n++] = 1;             //configurationVersion
+        buf[n++] = _sps[1];       //AVCProfileIndication
+        buf[n++] = _sps[2];       //profile_compatibility
+        buf[n++] = _sps[3];       //AVCLevelIndication
+        buf[n++] = 0xFF;          //lengthSizeMinusOne = 3
+        buf[n++] = 0xE1;          //numOfSequenceParameterSets = 1
+        buf[n++] = (unsigned char)(_sps_length >> 8);
+        buf[n++] = (unsigned char)_sps_length;
+        memcpy(buf + n, _sps, _sps_length);
+        n += _sps_length;
+        buf[n++] = 1;             //numOfPictureParameterSets
+        buf[n++] = (unsigned char)(_pps_length >> 8);
+        buf[n++] = (unsigned char)_pps_length;
+        memcpy(buf + n, _pps, _pps_length);
+        n += _pps_length;
+        return n;
+    }
+
+    /*****************************************************
+    Annex-B output: only an IDR that arrives without its parameter sets
+    changes, the cached SPS/PPS go in front of its start code and the rest is
+    copied around them. Every other access unit passes through untouched.
+    ******************************************************/
+    private: bool splice(const void* data, size_t length, const void*& out, size_t& out_length)
+    {
+        const unsigned char* idr = NULL;
+        bool has_sps = false, has_pps = false, missing = false;
+        c920_nal_reader_t reader(data, length);
+        c920_nal_t nal;
+        while (reader.next(nal))
+        {
+            cache(nal);
+            if (nal.type == NAL_SPS) has_sps = true;
+            if (nal.type == NAL_PPS) has_pps = true;
+            if (nal.type == NAL_IDR && !idr)
+            {
+                idr = nal.data - 3;
+                missing = !has_sps || !has_pps;
+            }
+        }
+
+        if (!_inject || !idr || !missing || !has_parameter_sets())
+        {
+            out = data;
+            out_length = length;
+            return true;
+        }
+
+        size_t head = idr - (const unsigned char*)data;
+        if (!_out || length + _sps_length + _pps_length + 8 > _capacity) return false;
+        memcpy(_out, data, head);
+        size_t n = head;
+        emit(n, _sps, _sps_length);
+        emit(n, _pps, _pps_length);
+        memcpy(_out + n, idr, length - head);
+        _injected++;
+
+        out = _out;
+        out_length = n + length - head;
+        return true;
+    }
+
+    private: void cache(const c920_nal_t& nal)
+    {
+        if (nal.length > MAX_PARAMETER_SET) return;
+        if (nal.type == NAL_SPS) { memcpy(_sps, nal.data, nal.length); _sps_length = nal.length; }
+        else if (nal.type == NAL_PPS) { memcpy(_pps, nal.data, nal.length); _pps_length = nal.length; }
+    }
+
+    //Append a NAL with a start code or length prefix
+    private: bool emit(size_t& n, const unsigned char* data, size_t length)
+    {
+        if (n + 4 + length > _capacity) return false;
+        if (_output == H264_AVCC)
+        {
+            _out[n++] = (unsigned char)(length >> 24);
+            _out[n++] = (unsigned char)(length >> 16);
+            _out[n++] = (unsigned char)(length >> 8);
+            _out[n++] = (unsigned char)length;
+        }
+        else
+        {
+            _out[n++] = 0;
+            _out[n++] = 0;
+            _out[n++] = 0;
+            _out[n++] = 1;
+        }
+        memcpy(_out + n, data, length);
+        n += length;
+        return true;
+    }
+};
+
+
+/*****************************************************
+Exp-Golomb bit reader over a NAL payload, skipping emulation prevention
+bytes (00 00 03). Reads past the end return zeros.
+******************************************************/
+class c920_bit_reader_t
+{
+    private: const unsigned char* _p;
+    private: const unsigned char* _end;
+    private: int _bit;
+    private: int _zeros;
+
+    public: c920_bit_reader_t(const unsigned char* data, size_t length) : _p(data), _end(data + length), _bit(7), _zeros(0) {}
+
+    public: unsigned int bit()
+    {
+        if (_p >= _end) return 0;
+        unsigned int b = (*_p >> _bit) & 1;
+        if (--_bit < 0)
+        {
+            _bit = 7;
+            _zeros = *_p == 0 ? _zeros + 1 : 0;
+            _p++;
+            if (_zeros >= 2 && _p < _end && *_p == 3) { _p++; _zeros = 0; }
+        }
+        return b;
+    }
+
+    public: unsigned int bits(int n)
+    {
+        unsigned int v = 0;
+        while (n--) v = (v << 1) | bit();
+        return v;
+    }
+
+    public: unsigned int ue()
+    {
+        int leading = 0;
+        while (!bit() && leading < 32) leading++;
+        return leading ? ((1u << leading) - 1) + bits(leading) : 0;
+    }
+};
+
+//Per frame result of the analyzer
+struct c920_h264_frame_info_t
+{
+    public: unsigned long index;
+    public: long long timestamp_us;
+    public: char type;                 //'I' (IDR), 'i' (non-IDR I), 'P' or 'B'
+    public: size_t bytes;
+    public: unsigned long gop;         //Frames since the last I frame, 0 for I frames
+    public: double window_bps;         //Bitrate over the sliding window ending at this frame
+    public: bool spike;
+    public: bool over_peak;            //window_bps is above the peak target
+};
+
+/*****************************************************
+Reports what the encoder actually produces: frame types from the slice
+headers, sizes, GOP length and the bitrate over a sliding window against the
+average/peak targets, flagging every frame whose window is above the peak.
+Feed whole access units with analyze() (live capture) or single NAL units
+with feed() (offline files, access unit boundaries are detected from
+AUD/SPS/PPS/SEI and first_mb_in_slice == 0).
+Writes a per-frame CSV and/or a periodic summary.
+******************************************************/
+class c920_h264_analyzer_t
+{
+    private: struct _sample { long long timestamp_us; size_t bytes; };
+
+    private: double _fps;
+    private: long _target_average;
+    private: long _target_peak;
+    private: long long _window_us;
+    private: double _spike_factor;
+    private: FILE* _csv;
+    private: FILE* _summary;
+    private: long long _summary_us;
+    private: long long _origin_us;         //Timestamp of the first frame, times are reported from it
+
+    private: _sample* _window;
+    private: size_t _window_capacity;
+    private: size_t _window_head;
+    private: size_t _window_size;
+    private: unsigned long long _window_bytes;
+
+    private: double _mean_bytes;           //Running mean frame size when there is no target
+    private: unsigned long _frames;
+    private: unsigned long _gop;
+    private: unsigned long _last_gop_length;
+
+    //Access unit being assembled by feed()
+    private: bool _au_slice;
+    private: bool _au_idr;
+    private: int _au_slice_type;
+    private: size_t _au_bytes;
+    private: long long _au_timestamp_us;
+
+    //Summary interval counters
+    private: long long _interval_start_us;
+    private: unsigned long _n_frames, _n_idr, _n_i, _n_p, _n_b, _n_spikes, _n_over_peak;
+    private: unsigned long long _n_bytes;
+    private: size_t _n_largest;
+    private: char _n_largest_type;
+    private: double _n_window_max;
+
+    /*****************************************************
+    fps sets the bytes per frame the targets imply, targets are in bit/s (0 if
+    unknown, spikes are then measured against the running mean frame size).
+    A frame is a spike when it is spike_factor times larger than that.
+    ******************************************************/
+    public: c920_h264_analyzer_t(double fps, long target_average, long target_peak, long window_ms, double spike_factor, FILE* csv, FILE* summary, double summary_s)
+    {
+        _fps = fps > 0 ? fps : 30;
+        _target_average = target_average;
+        _target_peak = target_peak;
+        _window_us = (long long)(window_ms > 0 ? window_ms : 1000) * 1000;
+        _spike_factor = spike_factor > 0 ? spike_factor : 3;
+        _csv = csv;
+        _summary = summary;
+        _summary_us = (long long)(summary_s * 1e6);
+
+        //Room for twice the nominal frame count of a window
+        _window_capacity = (size_t)(_fps * _window_us / 1e6 * 2) + 16;
+        _window = (_sample*) calloc(_window_capacity, sizeof(_sample));
+        _window_head = _window_size = 0;
+        _window_bytes = 0;
+
+        _mean_bytes = 0;
+        _frames = 0;
+        _gop = 0;
+        _last_gop_length = 0;
+        _au_slice = _au_idr = false;
+        _au_slice_type = -1;
+        _au_bytes = 0;
+        _au_timestamp_us = 0;
+        _interval_start_us = -1;
+        _origin_us = -1;
+        reset_interval();
+
+        if (_csv) fprintf(_csv, "frame,time_s,type,bytes,gop,window_kbps,spike,over_peak\n");
+    }
+
+    public: ~c920_h264_analyzer_t() { free(_window); }
+
+    public: unsigned long frames() const { return _frames; }
+
+    //Analyze one complete access unit, as dequeued from the camera
+    public: void analyze(const void* data, size_t length, long long timestamp_us)
+    {
+        bool idr = false;
+        int slice_type = -1;
+        c920_nal_reader_t reader(data, length);
+        c920_nal_t nal;
+        while (reader.next(nal))
+        {
+            if (nal.type == NAL_IDR) idr = true;
+            if ((nal.type == NAL_IDR || nal.type == NAL_SLICE) && slice_type < 0) slice_type = parse_slice_type(nal);
+        }
+        if (slice_type < 0 && !idr) return;
+        frame(idr, slice_type, length, timestamp_us);
+    }
+
+    //Analyze a stream one NAL at a time. timestamp_us is the time of the access unit the NAL
+    //belongs to, negative derives it from the frame count and the frame rate.
+    public: void feed(const c920_nal_t& nal, long long timestamp_us = -1)
+    {
+        bool slice = nal.type == NAL_SLICE || nal.type == NAL_IDR;
+        bool starts_au = nal.type == NAL_AUD || nal.type == NAL_SPS || nal.type == NAL_PPS || nal.type == NAL_SEI ||
+            (slice && first_mb(nal) == 0);
+        if (_au_slice && starts_au) flush();
+        if (!_au_bytes) _au_timestamp_us = timestamp_us >= 0 ? timestamp_us : (long long)(_frames * 1e6 / _fps);
+
+        _au_bytes += nal.length + 4;
+        if (slice)
+        {
+            if (!_au_slice) _au_slice_type = parse_slice_type(nal);
+            _au_slice = true;
+            if (nal.type == NAL_IDR) _au_idr = true;
+        }
+    }
+
+    //Finish the access unit assembled by feed()
+    public: void flush()
+    {
+        if (_au_slice) frame(_au_idr, _au_slice_type, _au_bytes, _au_timestamp_us);
+        _au_slice = _au_idr = false;
+        _au_slice_type = -1;
+        _au_bytes = 0;
+    }
+
+    //Print the summary for the frames since the last one
+    public: void summary()
+    {
+        if (!_summary || !_n_frames) return;
+        double seconds = (last_timestamp_us() - _interval_start_us) / 1e6 + 1 / _fps;
+        double avg = _n_bytes * 8 / seconds;
+        fprintf(_summary, "t=%.1fs frames=%lu IDR=%lu I=%lu P=%lu B=%lu gop=%lu avg=%.0fkbps window_max=%.0fkbps",
+            (last_timestamp_us() - _origin_us) / 1e6, _n_frames, _n_idr, _n_i, _n_p, _n_b, _last_gop_length, avg / 1000, _n_window_max / 1000);
+        if (_target_average) fprintf(_summary, " target=%ld/%ldkbps (%.0f%%)", _target_average / 1000, _target_peak / 1000, 100 * avg / _target_average);
+        if (_target_peak) fprintf(_summary, " over_peak=%lu", _n_over_peak);
+        fprintf(_summary, " largest=%zuB(%c) spikes=%lu\n", _n_largest, _n_largest_type, _n_spikes);
+        fflush(_summary);
+        reset_interval();
+    }
+
+    private: long long last_timestamp_us() const
+    {
+        return _window_size ? _window[(_window_head + _window_size - 1) % _window_capacity].timestamp_us : 0;
+    }
+
+    private: void reset_interval()
+    {
+        _n_frames = _n_idr = _n_i = _n_p = _n_b = _n_spikes = _n_over_peak = 0;
+        _n_bytes = 0;
+        _n_largest = 0;
+        _n_largest_type = '-';
+        _n_window_max = 0;
+        _interval_start_us = -1;
+    }
+
+    private: void frame(bool idr, int slice_type, size_t bytes, long long timestamp_us)
+    {
+        //Close the summary interval before this frame if it is due
+        if (_summary && _summary_us > 0 && _interval_start_us >= 0 && timestamp_us - _interval_start_us >= _summary_us) summary();
+
+        if (_origin_us < 0) _origin_us = timestamp_us;
+
+        c920_h264_frame_info_t f;
+        f.index = _frames++;
+        f.timestamp_us = timestamp_us;
+        f.bytes = bytes;
+
+        //slice_type 0/5 P, 1/6 B, 2/7 I, 3/8 SP, 4/9 SI
+        int t = slice_type % 5;
+        f.type = idr ? 'I' : (t == 2 || t == 4) ? 'i' : t == 1 ? 'B' : 'P';
+        if (f.type == 'I' || f.type == 'i')
+        {
+            if (_frames > 1) _last_gop_length = _gop + 1;
+            _gop = 0;
+        }
+        else _gop++;
+        f.gop = _gop;
+
+        //Slide the window
+        while (_window_size && (timestamp_us - _window[_window_head].timestamp_us >= _window_us || _window_size == _window_capacity))
+        {
+            _window_bytes -= _window[_window_head].bytes;
+            _window_head = (_window_head + 1) % _window_capacity;
+            _window_size--;
+        }
+        _sample& s = _window[(_window_head + _window_size) % _window_capacity];
+        s.timestamp_us = timestamp_us;
+        s.bytes = bytes;
+        _window_size++;
+        _window_bytes += bytes;
+        f.window_bps = _window_bytes * 8 / (_window_us / 1e6);
+        f.over_peak = _target_peak > 0 && f.window_bps > _target_peak;
+
+        //Spikes against the target bytes per frame, or the running mean without a target
+        double reference = _target_average ? _target_average / 8.0 / _fps : _mean_bytes;
+        f.spike = reference > 0 && bytes > _spike_factor * reference;
+        _mean_bytes = _frames == 1 ? bytes : _mean_bytes * 0.95 + bytes * 0.05;
+
+        if (_csv)
+            fprintf(_csv, "%lu,%.6f,%c,%zu,%lu,%.1f,%d,%d\n", f.index, (f.timestamp_us - _origin_us) / 1e6, f.type, f.bytes, f.gop, f.window_bps / 1000,
+                f.spike ? 1 : 0, f.over_peak ? 1 : 0);
+
+        if (_interval_start_us < 0) _interval_start_us = timestamp_us;
+        _n_frames++;
+        _n_bytes += bytes;
+        if (f.type == 'I') _n_idr++;
+        else if (f.type == 'i') _n_i++;
+        else if (f.type == 'B') _n_b++;
+        else _n_p++;
+        if (f.spike) _n_spikes++;
+        if (f.over_peak) _n_over_peak++;
+        if (bytes > _n_largest) { _n_largest = bytes; _n_largest_type = f.type; }
+        if (f.window_bps > _n_window_max) _n_window_max = f.window_bps;
+    }
+
+    private: static unsigned int first_mb(const c920_nal_t& nal)
+    {
+        c920_bit_reader_t r(nal.data + 1, nal.length - 1);
+        return r.ue();
+    }
+
+    private: static int parse_slice_type(const c920_nal_t& nal)
+    {
+        c920_bit_reader_t r(nal.data + 1, nal.length - 1);
+        r.ue();                 //first_mb_in_slice
+        return (int)r.ue();     //slice_type
+    }
+};
+
+#endif
@@ -0,0 +1,374 @@
+#ifndef C920_MJPEG_H
+#define C920_MJPEG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+//JPEG markers
+const unsigned char JPEG_SOI = 0xD8;
+const unsigned char JPEG_EOI = 0xD9;
+const unsigned char JPEG_SOS = 0xDA;
+const unsigned char JPEG_DQT = 0xDB;
+const unsigned char JPEG_DHT = 0xC4;
+
+//Validation results
+const int MJPEG_OK = 0;
+const int MJPEG_NO_SOI = 1;           //Does not start with SOI
+const int MJPEG_BAD_SEGMENT = 2;      //Garbage where a marker should be, or a segment length below 2
+const int MJPEG_MISSING_HEADER = 3;   //Scan without SOF or DQT in front of it, or EOI before any scan
+const int MJPEG_TRUNCATED = 4;        //Ends inside a segment or the scan, no EOI
+const int MJPEG_BAD_SIZE = 5;         //SOF size differs from the negotiated frame size
+const int MJPEG_STATUSES = 6;
+
+static const char* const c920_mjpeg_status_names[MJPEG_STATUSES] = { "ok", "no_soi", "bad_segment", "missing_header", "truncated", "bad_size" };
+
+/*****************************************************
+Find the next marker in entropy coded data in [p, end): an FF that is not
+byte stuffing (FF 00), a restart marker (FF D0-D7) or fill in front of
+another FF. Returns a pointer to the FF, or end if there is none. With SSE2
+16 bytes are tested for FF per iteration and only hits are looked at.
+******************************************************/
+static inline const unsigned char* c920_find_marker(const unsigned char* p, const unsigned char* end)
+{
+#ifdef __SSE2__
+    const __m128i ff = _mm_set1_epi8((char)0xFF);
+    while (end - p >= 17)
+    {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), ff));
+        while (mask)
+        {
+            const unsigned char* q = p + __builtin_ctz(mask);
+            unsigned char m = q[1];
+            if (m != 0x00 && m != 0xFF && (m & 0xF8) != 0xD0) return q;
+            mask &= mask - 1;
+        }
+        p += 16;
+    }
+#endif
+    for (; end - p >= 2; p++)
+    {
+        if (p[0] != 0xFF) continue;
+        unsigned char m = p[1];
+        if (m != 0x00 && m != 0xFF && (m & 0xF8) != 0xD0) return p;
+    }
+    return end;
+}
+
+//What the validator found in a frame
+struct c920_mjpeg_info_t
+{
+    public: int status;             //MJPEG_OK or the first problem found
+    public: size_t length;          //Bytes up to and including EOI, what is left after trimming
+    public: size_t sos_offset;      //Offset of the first SOS marker
+    public: bool has_dht;
+    public: unsigned int width;     //From SOF, 0 if there was none
+    public: unsigned int height;
+};
+
+//Counters kept by c920_mjpeg_validator_t
+struct c920_mjpeg_stats_t
+{
+    public: unsigned long frames;
+    public: unsigned long valid;
+    public: unsigned long corrupt;
+    public: unsigned long reasons[MJPEG_STATUSES];   //Corrupt frames by status
+    public: unsigned long trimmed;                   //Valid frames with bytes after EOI
+    public: unsigned long long trimmed_bytes;
+    public: unsigned long dht_inserted;
+};
+
+/*****************************************************
+Validates MJPEG frames as they come out of the camera: walks the marker
+segments, scans the entropy coded data for the terminating EOI and trims
+whatever follows it. Optionally inserts the standard Huffman tables (JPEG
+Annex K.3) that UVC MJPEG leaves out, so the frames decode as plain JPEG
+files. All memory is allocated up front; valid frames that need no DHT are
+passed through untouched.
+******************************************************/
+class c920_mjpeg_validator_t
+{
+    public: static const size_t DHT_SIZE = 420;
+
+    private: unsigned char _dht[DHT_SIZE];
+    private: unsigned char* _out;
+    private: size_t _capacity;
+    private: bool _insert_dht;
+    private: unsigned int _width;
+    private: unsigned int _height;
+    private: c920_mjpeg_stats_t _stats;
+
+    //max_frame is the largest buffer that will be validated, width and height are checked against SOF unless 0
+    public: c920_mjpeg_validator_t(size_t max_frame, bool insert_dht, unsigned int width, unsigned int height)
+    {
+        _insert_dht = insert_dht;
+        _width = width;
+        _height = height;
+        memset(&_stats, 0, sizeof(_stats));
+        build_dht();
+
+        _capacity = insert_dht ? output_size(max_frame) : 0;
+        _out = insert_dht ? (unsigned char*) malloc(_capacity) : NULL;
+    }
+
+    public: ~c920_mjpeg_validator_t() { free(_out); }
+
+    //Largest frame process() can produce from a max_frame buffer
+    public: static size_t output_size(size_t max_frame) { return max_frame + DHT_SIZE; }
+
+    public: bool valid() const { return !_insert_dht || _out != NULL; }
+    public: const c920_mjpeg_stats_t& stats() const { return _stats; }
+
+    /*****************************************************
+    Validate one frame. out points at the frame to hand on: trimmed, with the
+    DHT inserted if asked for, or the original buffer if it is corrupt.
+    Returns the status, it is up to the caller to drop or keep corrupt frames.
+    ******************************************************/
+    public: int process(const void* data, size_t length, const void*& out, size_t& out_length)
+    {
+        c920_mjpeg_info_t info;
+        _stats.frames++;
+        out = data;
+        out_length = length;
+
+        if (check(data, length, info) != MJPEG_OK)
+        {
+            _stats.corrupt++;
+            _stats.reasons[info.status]++;
+            return info.status;
+        }
+        _stats.valid++;
+
+        if (info.length < length)
+        {
+            _stats.trimmed++;
+            _stats.trimmed_bytes += length - info.length;
+        }
+        out_length = info.length;
+
+        if (_insert_dht && !info.has_dht && info.length + DHT_SIZE <= _capacity)
+        {
+            const unsigned char* p = (const unsigned char*)data;
+            memcpy(_out, p, info.sos_offset);
+            memcpy(_out + info.sos_offset, _dht, DHT_SIZE);
+            memcpy(_out + info.sos_offset + DHT_SIZE, p + info.sos_offset, info.length - info.sos_offset);
+            out = _out;
+            out_length = info.length + DHT_SIZE;
+            _stats.dht_inserted++;
+        }
+        return MJPEG_OK;
+    }
+
+    //Walk the frame without touching the counters
+    public: int check(const void* data, size_t length, c920_mjpeg_info_t& info) const
+    {
+        const unsigned char* p = (const unsigned char*)data;
+        const unsigned char* end = p + length;
+        memset(&info, 0, sizeof(info));
+
+        if (length < 4 || p[0] != 0xFF || p[1] != JPEG_SOI) return info.status = MJPEG_NO_SOI;
+        const unsigned char* start = p;
+        p += 2;
+
+        bool dqt = false, sof = false;
+        for (;;)
+        {
+            if (end - p < 2) return info.status = MJPEG_TRUNCATED;
+            if (p[0] != 0xFF) return info.status = MJPEG_BAD_SEGMENT;
+            while (end - p >= 2 && p[1] == 0xFF) p++;
+            if (end - p < 2) return info.status = MJPEG_TRUNCATED;
+
+            unsigned char m = p[1];
+            const unsigned char* marker = p;
+            p += 2;
+            if (m == JPEG_EOI)
+            {
+                if (!info.sos_offset) return info.status = MJPEG_MISSING_HEADER;
+                info.length = p - start;
+                break;
+            }
+            if ((m & 0xF8) == 0xD0 || m == 0x01) continue;   //RSTn and TEM have no length
+
+            if (end - p < 2) return info.status = MJPEG_TRUNCATED;
+            size_t len = (p[0] << 8) | p[1];
+            if (len < 2) return info.status = MJPEG_BAD_SEGMENT;
+            if ((size_t)(end - p) < len) return info.status = MJPEG_TRUNCATED;
+
+            if (m == JPEG_DHT) info.has_dht = true;
+            else if (m == JPEG_DQT) dqt = true;
+            else if (m >= 0xC0 && m <= 0xCF && m != 0xC8 && m != 0xCC)
+            {
+                if (len < 8) return info.status = MJPEG_BAD_SEGMENT;
+                sof = true;
+                info.height = (p[3] << 8) | p[4];
+                info.width = (p[5] << 8) | p[6];
+                if ((_width && info.width != _width) || (_height && info.height != _height)) return info.status = MJPEG_BAD_SIZE;
+            }
+            p += len;
+
+            if (m == JPEG_SOS)
+            {
+                if (!sof || !dqt) return info.status = MJPEG_MISSING_HEADER;
+                if (!info.sos_offset) info.sos_offset = marker - start;
+
+                //Entropy coded data runs up to the next real marker: EOI, or the tables of another scan
+                p = c920_find_marker(p, end);
+                if (p == end) return info.status = MJPEG_TRUNCATED;
+            }
+        }
+        return info.status = MJPEG_OK;
+    }
+
+    //Standard luminance and chrominance tables as one DHT segment
+    private: void build_dht()
+    {
+        static const unsigned char dc_luma_bits[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+        static const unsigned char dc_chroma_bits[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+        static const unsigned char dc_values[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+        static const unsigned char ac_luma_bits[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+        static const unsigned char ac_luma_values[162] = {
+            0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+            0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+            0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+            0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+            0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+            0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+            0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+            0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+            0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+            0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+            0xf9, 0xfa };
+        static const unsigned char ac_chroma_bits[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+        static const unsigned char ac_chroma_values[162] = {
+            0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+            0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+            0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+            0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+            0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+            0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+            0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+            0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+            0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+            0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+            0xf9, 0xfa };
+
+        unsigned char* p = _dht;
+        *p++ = 0xFF;
+        *p++ = JPEG_DHT;
+        *p++ = (DHT_SIZE - 2) >> 8;
+        *p++ = (DHT_SIZE - 2) & 0xFF;
+        p = put_table(p, 0x00, dc_luma_bits, dc_values);
+        p = put_table(p, 0x10, ac_luma_bits, ac_luma_values);
+        p = put_table(p, 0x01, dc_chroma_bits, dc_values);
+        p = put_table(p, 0x11, ac_chroma_bits, ac_chroma_values);
+    }
+
+    private: static unsigned char* put_table(unsigned char* p, unsigned char id, const unsigned char* bits, const unsigned char* values)
+    {
+        size_t n = 0;
+        *p++ = id;
+        for (int i=0; i<16; i++) n += bits[i];
+        memcpy(p, bits, 16);
+        memcpy(p + 16, values, n);
+        return p + 16 + n;
+    }
+};
+
+//Output modes of c920_mjpeg_writer_t
+const int MJPEG_FILES = 0;        //One file per frame, named from a printf pattern with the frame number
+const int MJPEG_MULTIPART = 1;    //multipart/x-mixed-replace parts with the boundary below
+
+/*****************************************************
+Writes validated frames as individual JPEG files or as a multipart stream
+(serve it with Content-Type: multipart/x-mixed-replace;boundary=c920frame).
+Meant to run as a tee sink so file creation stays off the capture thread.
+******************************************************/
+class c920_mjpeg_writer_t
+{
+    public: static const char* boundary() { return "c920frame"; }
+
+    private: int _mode;
+    private: char* _pattern;
+    private: FILE* _fp;
+    private: unsigned long _frames;
+    private: unsigned long _errors;
+
+    //pattern is used in MJPEG_FILES mode, fp in MJPEG_MULTIPART mode, check valid() after construction
+    public: c920_mjpeg_writer_t(int mode, const char* pattern, FILE* fp)
+        : _mode(mode), _pattern(mode == MJPEG_FILES && pattern ? frame_pattern(pattern) : NULL), _fp(fp), _frames(0), _errors(0) {}
+
+    //False if the files pattern is missing or does not have exactly one integer conversion
+    public: bool valid() const { return _mode != MJPEG_FILES || _pattern; }
+
+    public: ~c920_mjpeg_writer_t() { free(_pattern); }
+
+    public: unsigned long frames() const { return _frames; }
+    public: unsigned long errors() const { return _errors; }
+
+    public: bool write(const void* data, size_t length)
+    {
+        if (_mode == MJPEG_MULTIPART)
+        {
+            fprintf(_fp, "--%s\r\nContent-Type: image/jpeg\r\nContent-Length: %zu\r\n\r\n", boundary(), length);
+            fwrite(data, 1, length, _fp);
+            fputs("\r\n", _fp);
+            bool ok = fflush(_fp) == 0 && !ferror(_fp);
+            if (!ok) _errors++;
+            _frames++;
+            return ok;
+        }
+
+        char path[4096];
+        snprintf(path, sizeof(path), _pattern, (unsigned long long)_frames);
+        FILE* fp = fopen(path, "wb");
+        bool ok = fp && fwrite(data, 1, length, fp) == length;
+        if (fp && fclose(fp) != 0) ok = false;
+        if (!ok) _errors++;
+        _frames++;
+        return ok;
+    }
+
+    /*****************************************************
+    Check that a user pattern has exactly one integer conversion and no other
+    argument, and rewrite that conversion to take an unsigned long long so
+    %d, %06lu and %x all work. NULL if the pattern is not usable.
+    ******************************************************/
+    public: static char* frame_pattern(const char* pattern)
+    {
+        char* out = (char*) malloc(strlen(pattern) + 3);
+        if (!out) return NULL;
+        char* o = out;
+        int conversions = 0;
+        for (const char* p = pattern; *p; )
+        {
+            if (*p != '%') { *o++ = *p++; continue; }
+            *o++ = *p++;
+            if (*p == '%') { *o++ = *p++; continue; }
+
+            while (*p && strchr("-+ #0", *p)) *o++ = *p++;
+            while (*p >= '0' && *p <= '9') *o++ = *p++;
+            if (*p == '.') { *o++ = *p++; while (*p >= '0' && *p <= '9') *o++ = *p++; }
+            while (*p && strchr("hlLqjzt", *p)) p++;
+            if (!*p || !strchr("diouxX", *p) || ++conversions > 1) { free(out); return NULL; }
+
+            *o++ = 'l';
+            *o++ = 'l';
+            *o++ = (*p == 'd' || *p == 'i') ? 'u' : *p;
+            p++;
+        }
+        *o = 0;
+        if (conversions != 1) { free(out); return NULL; }
+        return out;
+    }
+
+    //c920_tee_t sink callback, user is the writer. A failed write disables the sink.
+    public: static int sink(const void* data, size_t length, bool keyframe, void* user)
+    {
+        return ((c920_mjpeg_writer_t*)user)->write(data, length) ? 1 : 0;
+    }
+};
+
+#endif
@@ -0,0 +1,362 @@
+#ifndef C920_SCALE_H
+#define C920_SCALE_H
+
+#include "c920capture.h"
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+//Resampling kernels
+const int SCALE_BOX = 0;        //Uniform average of round(scale) source pixels
+const int SCALE_BILINEAR = 1;   //Two nearest source pixels, no prefilter
+const int SCALE_AREA = 2;       //Exact coverage of the output pixel footprint
+
+/*****************************************************
+Separable YUYV resampler for one ROI and output size. Taps are fixed point
+weights summing to 256, built once per axis. The vertical pass runs over the
+interleaved row (it never mixes channels) with SSE2, the horizontal pass
+then uses per-channel tap tables: luma on the full grid, U and V on the half
+grid with chroma co-sited with the even luma samples as 4:2:2 specifies.
+******************************************************/
+class c920_resampler_t
+{
+    private: struct _axis { int taps; int* offset; short* weight; };
+
+    private: size_t _src_stride;
+    private: size_t _roi_x, _roi_y, _roi_w, _roi_h;
+    private: size_t _out_w, _out_h;
+    private: _axis _vertical;        //Source rows per output row
+    private: _axis _luma;            //Byte offsets into the intermediate row per output luma sample
+    private: _axis _chroma;          //Byte offsets of U per output chroma pair, V is 2 bytes further
+    private: unsigned short* _mid;   //Vertically filtered ROI row, 8.8 fixed point
+
+    //ROI must lie inside a src_width x src_height frame, x and widths are rounded down to even
+    public: c920_resampler_t(size_t src_width, size_t src_height, size_t roi_x, size_t roi_y, size_t roi_w, size_t roi_h,
+        size_t out_w, size_t out_h, int kernel)
+    {
+        _roi_x = roi_x & ~(size_t)1;
+        _roi_y = roi_y;
+        _roi_w = roi_w & ~(size_t)1;
+        _roi_h = roi_h;
+        _out_w = out_w & ~(size_t)1;
+        _out_h = out_h;
+        _src_stride = src_width * 2;
+        CLEAR(_vertical);
+        CLEAR(_luma);
+        CLEAR(_chroma);
+        _mid = 0;
+
+        if (!_roi_w || !_roi_h || !_out_w || !_out_h || _roi_x + _roi_w > src_width || _roi_y + _roi_h > src_height)
+            throw c920_exception_t("invalid scale region %dx%d+%d+%d of %dx%d", roi_w, roi_h, roi_x, roi_y, src_width, src_height);
+
+        double sx = (double)_roi_w / _out_w, sy = (double)_roi_h / _out_h;
+
+        build(_vertical, _out_h, _roi_h, sy, kernel, 1, 0, false);
+        for (size_t i=0; i<_out_h * _vertical.taps; i++) _vertical.offset[i] = (_vertical.offset[i] + _roi_y) * _src_stride + _roi_x * 2;
+        build(_luma, _out_w, _roi_w, sx, kernel, 2, 0, false);
+        build(_chroma, _out_w / 2, _roi_w / 2, sx, kernel, 4, 1, true);
+        int taps = _luma.taps > _chroma.taps ? _luma.taps : _chroma.taps;
+        pad(_luma, _out_w, taps);
+        pad(_chroma, _out_w / 2, taps);
+
+        _mid = (unsigned short*) calloc(_roi_w * 2 + 16, sizeof(unsigned short));
+        if (!_mid) throw c920_exception_t("out of memory");
+    }
+
+    public: ~c920_resampler_t()
+    {
+        free(_vertical.offset); free(_vertical.weight);
+        free(_luma.offset); free(_luma.weight);
+        free(_chroma.offset); free(_chroma.weight);
+        free(_mid);
+    }
+
+    public: size_t width() const { return _out_w; }
+    public: size_t height() const { return _out_h; }
+    public: size_t size() const { return _out_w * _out_h * 2; }
+
+    //Resample one YUYV frame into out, which holds size() bytes
+    public: void process(const unsigned char* src, unsigned char* out) const
+    {
+        size_t n = _roi_w * 2;
+        for (size_t y=0; y<_out_h; y++)
+        {
+            vertical(src, y, n);
+
+            unsigned char* row = out + y * _out_w * 2;
+            switch (_luma.taps)
+            {
+                case 1: horizontal<1>(row); break;
+                case 2: horizontal<2>(row); break;
+                case 3: horizontal<3>(row); break;
+                case 4: horizontal<4>(row); break;
+                default: horizontal<0>(row); break;
+            }
+        }
+    }
+
+    //Weighted sum of the source rows feeding output row y into _mid
+    private: void vertical(const unsigned char* src, size_t y, size_t n) const
+    {
+        const int* off = _vertical.offset + y * _vertical.taps;
+        const short* w = _vertical.weight + y * _vertical.taps;
+        size_t i = 0;
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i lo = zero, hi = zero;
+            for (int k=0; k<_vertical.taps; k++)
+            {
+                if (!w[k]) continue;
+                __m128i s = _mm_loadu_si128((const __m128i*)(src + off[k] + i));
+                __m128i wk = _mm_set1_epi16(w[k]);
+                lo = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), wk));
+                hi = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), wk));
+            }
+            _mm_storeu_si128((__m128i*)(_mid + i), lo);
+            _mm_storeu_si128((__m128i*)(_mid + i + 8), hi);
+        }
+#endif
+        for (; i < n; i++)
+        {
+            unsigned int acc = 0;
+            for (int k=0; k<_vertical.taps; k++) acc += src[off[k] + i] * w[k];
+            _mid[i] = (unsigned short)acc;
+        }
+    }
+
+    //One output row from _mid, luma on even bytes and U/V on the odd ones. TAPS is the
+    //shared luma/chroma tap count when it is small enough to unroll, 0 otherwise
+    private: template <int TAPS> void horizontal(unsigned char* row) const
+    {
+        const unsigned short* mid = _mid;
+        const int taps = TAPS ? TAPS : _luma.taps;
+        const int* loff = _luma.offset;
+        const short* lw = _luma.weight;
+        const int* coff = _chroma.offset;
+        const short* cw = _chroma.weight;
+        const size_t pairs = _out_w / 2;
+
+        for (size_t p=0; p<pairs; p++, row += 4, loff += 2 * taps, lw += 2 * taps, coff += taps, cw += taps)
+        {
+            unsigned int y0 = 32768, y1 = 32768, u = 32768, v = 32768;
+            for (int k=0; k<taps; k++)
+            {
+                y0 += mid[loff[k]] * lw[k];
+                y1 += mid[loff[taps + k]] * lw[taps + k];
+                u += mid[coff[k]] * cw[k];
+                v += mid[coff[k] + 2] * cw[k];
+            }
+
+            //Weights sum to 256 in both passes, so the results are already within 0..255
+            row[0] = (unsigned char)(y0 >> 16);
+            row[1] = (unsigned char)(u >> 16);
+            row[2] = (unsigned char)(y1 >> 16);
+            row[3] = (unsigned char)(v >> 16);
+        }
+    }
+
+    //Widen every entry of an axis to taps, repeating the first offset with zero weight
+    private: static void pad(_axis& a, size_t out_n, int taps)
+    {
+        if (a.taps == taps) return;
+        int* offset = (int*) calloc(out_n * taps, sizeof(int));
+        short* weight = (short*) calloc(out_n * taps, sizeof(short));
+        if (!offset || !weight) throw c920_exception_t("out of memory");
+        for (size_t o=0; o<out_n; o++)
+        {
+            for (int k=0; k<taps; k++)
+            {
+                offset[o * taps + k] = k < a.taps ? a.offset[o * a.taps + k] : a.offset[o * a.taps];
+                weight[o * taps + k] = k < a.taps ? a.weight[o * a.taps + k] : 0;
+            }
+        }
+        free(a.offset);
+        free(a.weight);
+        a.offset = offset;
+        a.weight = weight;
+        a.taps = taps;
+    }
+
+    /*****************************************************
+    Build taps for out_n samples from src_n with the given scale. Offsets are
+    src index * stride + base. Luma and rows are sampled at pixel centres,
+    chroma at the position of the even luma sample it is co-sited with.
+    ******************************************************/
+    private: static void build(_axis& a, size_t out_n, size_t src_n, double scale, int kernel, int stride, int base, bool cosited)
+    {
+        a.taps = kernel == SCALE_BILINEAR ? 2 : (int)ceil(scale) + 2;
+        a.offset = (int*) calloc(out_n * a.taps, sizeof(int));
+        a.weight = (short*) calloc(out_n * a.taps, sizeof(short));
+        if (!a.offset || !a.weight) throw c920_exception_t("out of memory");
+
+        double* wf = (double*) calloc(a.taps, sizeof(double));
+        int* idx = (int*) calloc(a.taps, sizeof(int));
+        int used = 1;
+        for (size_t o=0; o<out_n; o++)
+        {
+            double center = cosited ? ((2 * o + 0.5) * scale - 0.5) / 2 : (o + 0.5) * scale - 0.5;
+            int count = 0;
+
+            if (kernel == SCALE_BILINEAR)
+            {
+                double f = floor(center);
+                idx[0] = (int)f; wf[0] = 1 - (center - f);
+                idx[1] = (int)f + 1; wf[1] = center - f;
+                count = 2;
+            }
+            else if (kernel == SCALE_BOX)
+            {
+                int n = (int)(scale + 0.5);
+                if (n < 1) n = 1;
+                int first = (int)floor(center - (n - 1) / 2.0 + 0.5);
+                for (int k=0; k<n; k++) { idx[k] = first + k; wf[k] = 1.0 / n; }
+                count = n;
+            }
+            else
+            {
+                //Footprint [lo, hi) in edge coordinates, at least one source pixel wide
+                double width = scale > 1 ? scale : 1;
+                double lo = center + 0.5 - width / 2, hi = center + 0.5 + width / 2;
+                for (int s=(int)floor(lo); s<hi && count<a.taps; s++)
+                {
+                    double cover = (s + 1 < hi ? s + 1 : hi) - (s > lo ? s : lo);
+                    if (cover <= 0) continue;
+                    idx[count] = s;
+                    wf[count++] = cover / width;
+                }
+            }
+
+            //Quantize to 8 bit weights that sum to exactly 256, clamping indices to the edge
+            int sum = 0, largest = 0;
+            for (int k=0; k<count; k++)
+            {
+                int s = idx[k] < 0 ? 0 : idx[k] >= (int)src_n ? (int)src_n - 1 : idx[k];
+                a.offset[o * a.taps + k] = s * stride + base;
+                a.weight[o * a.taps + k] = (short)floor(wf[k] * 256 + 0.5);
+                sum += a.weight[o * a.taps + k];
+                if (a.weight[o * a.taps + k] > a.weight[o * a.taps + largest]) largest = k;
+            }
+            a.weight[o * a.taps + largest] += 256 - sum;
+            for (int k=count; k<a.taps; k++) a.offset[o * a.taps + k] = a.offset[o * a.taps];
+            if (count > used) used = count;
+        }
+        free(wf);
+        free(idx);
+
+        //Drop the padding taps no output needed so the inner loops stay as short as the kernel
+        for (size_t o=0; o<out_n; o++)
+        {
+            for (int k=0; k<used; k++)
+            {
+                a.offset[o * used + k] = a.offset[o * a.taps + k];
+                a.weight[o * used + k] = a.weight[o * a.taps + k];
+            }
+        }
+        a.taps = used;
+    }
+};
+
+/*****************************************************
+Produces several reduced YUYV outputs from each dequeued frame, each with
+its own ROI, size, kernel and rate. All output and scratch memory is
+allocated when the output is added.
+******************************************************/
+class c920_scaler_t
+{
+    //Return 0 to stop delivering this output
+    public: typedef int (*c920_scaled_cb)(const void* data, size_t length, size_t width, size_t height, void* user);
+
+    public: static const size_t MAX_OUTPUTS = 8;
+
+    private: struct _output
+    {
+        c920_resampler_t* resampler;
+        unsigned char* buffer;
+        double fps;
+        double phase;
+        bool enabled;
+        c920_scaled_cb cb;
+        void* user;
+        unsigned long frames;
+    };
+
+    private: size_t _width;
+    private: size_t _height;
+    private: double _fps;
+    private: _output _outputs[MAX_OUTPUTS];
+    private: size_t _num_outputs;
+
+    //Input frames are width x height YUYV arriving at fps
+    public: c920_scaler_t(size_t width, size_t height, double fps)
+    {
+        _width = width;
+        _height = height;
+        _fps = fps > 0 ? fps : 30;
+        _num_outputs = 0;
+    }
+
+    public: ~c920_scaler_t()
+    {
+        for (size_t i=0; i<_num_outputs; i++)
+        {
+            delete _outputs[i].resampler;
+            free(_outputs[i].buffer);
+        }
+    }
+
+    //Add an output of the ROI scaled to out_w x out_h, delivered at most fps times a second (0 for every frame)
+    public: size_t add_output(size_t roi_x, size_t roi_y, size_t roi_w, size_t roi_h, size_t out_w, size_t out_h,
+        int kernel, double fps, c920_scaled_cb cb, void* user)
+    {
+        if (_num_outputs == MAX_OUTPUTS) throw c920_exception_t("too many scaled outputs");
+
+        _output& o = _outputs[_num_outputs];
+        o.resampler = new c920_resampler_t(_width, _height, roi_x, roi_y, roi_w, roi_h, out_w, out_h, kernel);
+        o.buffer = (unsigned char*) malloc(o.resampler->size());
+        if (!o.buffer)
+        {
+            delete o.resampler;
+            throw c920_exception_t("out of memory");
+        }
+        memset(o.buffer, 0, o.resampler->size());
+        o.fps = fps > 0 && fps < _fps ? fps : _fps;
+        o.phase = _fps;
+        o.enabled = true;
+        o.cb = cb;
+        o.user = user;
+        o.frames = 0;
+
+        DEBUG("Scaled output %d: %dx%d+%d+%d -> %dx%d at %.1f fps", _num_outputs, roi_w, roi_h, roi_x, roi_y,
+            o.resampler->width(), o.resampler->height(), o.fps);
+        return _num_outputs++;
+    }
+
+    public: size_t num_outputs() const { return _num_outputs; }
+    public: unsigned long frames(size_t output) const { return _outputs[output].frames; }
+
+    //Run every output that is due for this frame
+    public: void process(const void* data, size_t length)
+    {
+        if (length < _width * _height * 2) return;
+        for (size_t i=0; i<_num_outputs; i++)
+        {
+            _output& o = _outputs[i];
+            if (!o.enabled) continue;
+
+            //Accumulate the output rate, deliver whenever a whole input interval has built up
+            o.phase += o.fps;
+            if (o.phase < _fps) continue;
+            o.phase -= _fps;
+
+            o.resampler->process((const unsigned char*)data, o.buffer);
+            o.frames++;
+            if (o.cb && !o.cb(o.buffer, o.resampler->size(), o.resampler->width(), o.resampler->height(), o.user))
+                o.enabled = false;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,301 @@
+#ifndef C920_SYNC_H
+#define C920_SYNC_H
+
+#include "c920capture.h"
+
+//Per camera synchronization statistics, skew and drift are relative to camera 0
+struct c920_sync_stats_t
+{
+    public: unsigned long frames;      //Frames dequeued
+    public: unsigned long matched;     //Frames delivered in a tuple
+    public: unsigned long missing;     //Tuples delivered or dropped without a frame from this camera
+    public: unsigned long dropped;     //Frames released without being delivered
+    public: long last_skew_us;         //Offset to camera 0 in the last complete tuple
+    public: double mean_skew_us;       //Mean offset to camera 0 over complete tuples
+    public: double drift_ppm;          //Slope of the offset to camera 0 over time
+
+    //Least squares accumulators for drift, x in seconds since the first tuple, y in microseconds
+    public: double sx, sy, sxx, sxy;
+    public: unsigned long n;
+};
+
+/*****************************************************
+Groups frames from several devices into tuples by V4L2 buffer timestamp.
+Each device gets a bounded queue of dequeued buffers; frames are handed to
+the callback by reference into the mapped buffers and released afterwards.
+Missing frames show up as NULL entries in the tuple, or the tuple is dropped
+if partial tuples are disabled.
+******************************************************/
+class c920_sync_t
+{
+    //Return 0 to stop capture, frames[i] is NULL if camera i has no frame in this tuple
+    public: typedef int (*c920_tuple_cb)(const c920_frame_t* const* frames, size_t count, void* user);
+
+    private: struct _queue { c920_frame_t* frames; size_t head; size_t size; size_t depth; long long latest_us; bool seen; };
+
+    private: c920_device_t** _devices;
+    private: size_t _count;
+    private: _queue* _queues;
+    private: const c920_frame_t** _tuple;
+    private: c920_sync_stats_t* _stats;
+    private: long _tolerance_us;
+    private: bool _partial;
+    private: long long _origin_us;
+    private: c920_tuple_cb _cb;
+    private: void* _user;
+
+    //Depth is clamped so that every device keeps at least one buffer queued in the driver
+    public: c920_sync_t(c920_device_t** devices, size_t count, long tolerance_us, size_t depth, bool partial, c920_tuple_cb cb, void* user)
+    {
+        if (!count) throw c920_exception_t("no devices to synchronize");
+
+        _count = count;
+        _tolerance_us = tolerance_us;
+        _partial = partial;
+        _origin_us = -1;
+        _cb = cb;
+        _user = user;
+
+        _devices = (c920_device_t**) calloc(count, sizeof(c920_device_t*));
+        _queues = (_queue*) calloc(count, sizeof(_queue));
+        _tuple = (const c920_frame_t**) calloc(count, sizeof(c920_frame_t*));
+        _stats = (c920_sync_stats_t*) calloc(count, sizeof(c920_sync_stats_t));
+        if (!_devices || !_queues || !_tuple || !_stats) throw c920_exception_t("out of memory");
+
+        for (size_t i=0; i<count; i++)
+        {
+            _devices[i] = devices[i];
+            size_t d = depth;
+            if (d + 1 > devices[i]->num_buffers()) d = devices[i]->num_buffers() - 1;
+            if (d < 1) d = 1;
+            _queues[i].depth = d;
+            _queues[i].frames = (c920_frame_t*) calloc(d, sizeof(c920_frame_t));
+            if (!_queues[i].frames) throw c920_exception_t("out of memory");
+            DEBUG("Synchronizing camera %d with queue depth %d", i, d);
+        }
+    }
+
+    public: ~c920_sync_t()
+    {
+        for (size_t i=0; i<_count; i++)
+        {
+            while (_queues[i].size)
+            {
+                try { _devices[i]->release(front(i)); }
+                catch (c920_exception_t &e) { DEBUG("W: %s", e.message()); }
+                pop(i);
+            }
+            free(_queues[i].frames);
+        }
+        free(_devices);
+        free(_queues);
+        free(_tuple);
+        free(_stats);
+    }
+
+    public: const c920_sync_stats_t& stats(size_t camera) const { return _stats[camera]; }
+
+    /*****************************************************
+    Wait for frames on any device, then deliver every tuple that can be
+    completed. Call this in a loop. Supervised devices are never waited on
+    longer than their stall timeout; a device that stays silent is recovered
+    by its own check_stall() and the others keep being matched meanwhile.
+    Without supervision a 2s silence on every device is fatal as before.
+    ******************************************************/
+    public: int process()
+    {
+        fd_set fds;
+        FD_ZERO(&fds);
+        int nfds = 0;
+        bool wait = false;
+        bool supervised = false;
+        long timeout_us = 2000000;
+        for (size_t i=0; i<_count; i++)
+        {
+            if (_devices[i]->supervised())
+            {
+                supervised = true;
+                long t = _devices[i]->wait_timeout_us();
+                if (t < timeout_us) timeout_us = t;
+            }
+            if (_queues[i].size == _queues[i].depth) continue;
+            wait = true;
+
+            //No fd while the device is being reopened, select() then just sleeps
+            int fd = _devices[i]->fd();
+            if (fd == -1) continue;
+            FD_SET(fd, &fds);
+            if (fd >= nfds) nfds = fd + 1;
+        }
+
+        if (wait)
+        {
+            timeval tv;
+            tv.tv_sec = timeout_us / 1000000;
+            tv.tv_usec = timeout_us % 1000000;
+
+            switch (select(nfds, &fds, NULL, NULL, &tv))
+            {
+                case -1:
+                {
+                    if (errno == EINTR) return 1;
+                    else throw c920_exception_t("Could not select synchronized devices");
+                }
+                case 0:
+                {
+                    if (!supervised) throw c920_exception_t("timeout occurred while selecting synchronized devices");
+                    break;
+                }
+                default:
+                {
+                    for (size_t i=0; i<_count; i++)
+                    {
+                        int fd = _devices[i]->fd();
+                        if (fd != -1 && FD_ISSET(fd, &fds)) fill(i);
+                    }
+                }
+            }
+        }
+
+        for (size_t i=0; i<_count; i++)
+        {
+            if (_devices[i]->check_stall()) DEBUG("W: recovering synchronized camera %d", (int)i);
+        }
+
+        //A recovery inside dequeue() or release() may have unmapped what is still queued
+        for (size_t i=0; i<_count; i++) purge(i);
+        return match();
+    }
+
+    //Dequeue everything the device has ready, up to the queue depth
+    private: void fill(size_t i)
+    {
+        _queue& q = _queues[i];
+        while (q.size < q.depth)
+        {
+            c920_frame_t& slot = q.frames[(q.head + q.size) % q.depth];
+            if (!_devices[i]->dequeue(slot)) break;
+
+            //Popping stale frames off the head leaves the new one at head + size
+            purge(i);
+            q.size++;
+            q.latest_us = slot.timestamp_us;
+            q.seen = true;
+            _stats[i].frames++;
+        }
+    }
+
+    /*****************************************************
+    Take the oldest queued frame as reference. Every camera is either matched
+    (its head is within tolerance), missing (it is already past the reference)
+    or pending (nothing newer seen yet). Pending cameras stall matching unless
+    a queue is full, in which case they count as missing.
+    ******************************************************/
+    private: int match()
+    {
+        for (;;)
+        {
+            long long ref = 0;
+            bool any = false, full = false;
+            for (size_t i=0; i<_count; i++)
+            {
+                if (!_queues[i].size) continue;
+                if (!any || front(i).timestamp_us < ref) ref = front(i).timestamp_us;
+                if (_queues[i].size == _queues[i].depth) full = true;
+                any = true;
+            }
+            if (!any) return 1;
+
+            size_t matched = 0;
+            bool pending = false;
+            for (size_t i=0; i<_count; i++)
+            {
+                _tuple[i] = NULL;
+                if (_queues[i].size)
+                {
+                    if (front(i).timestamp_us - ref <= _tolerance_us)
+                    {
+                        _tuple[i] = &front(i);
+                        matched++;
+                    }
+                }
+                else if (!_queues[i].seen || _queues[i].latest_us <= ref + _tolerance_us) pending = true;
+            }
+            if (pending && !full) return 1;
+
+            int r = 1;
+            if (matched == _count) account();
+            for (size_t i=0; i<_count; i++) if (!_tuple[i]) _stats[i].missing++;
+
+            if (matched == _count || _partial)
+            {
+                for (size_t i=0; i<_count; i++) if (_tuple[i]) _stats[i].matched++;
+                if (_cb) r = _cb(_tuple, _count, _user);
+            }
+            else
+            {
+                for (size_t i=0; i<_count; i++) if (_tuple[i]) _stats[i].dropped++;
+            }
+
+            for (size_t i=0; i<_count; i++)
+            {
+                if (!_tuple[i]) continue;
+                _devices[i]->release(front(i));
+                pop(i);
+            }
+
+            //A failed QBUF recovers the device and leaves the rest of its queue stale
+            for (size_t i=0; i<_count; i++) purge(i);
+            if (!r) return 0;
+        }
+    }
+
+    //Update skew and drift of every camera against camera 0 from a complete tuple
+    private: void account()
+    {
+        long long t0 = _tuple[0]->timestamp_us;
+        if (_origin_us < 0) _origin_us = t0;
+        double x = (t0 - _origin_us) / 1e6;
+
+        for (size_t i=0; i<_count; i++)
+        {
+            c920_sync_stats_t& st = _stats[i];
+            long skew = (long)(_tuple[i]->timestamp_us - t0);
+            st.last_skew_us = skew;
+            st.n++;
+            st.sx += x;
+            st.sy += skew;
+            st.sxx += x * x;
+            st.sxy += x * skew;
+            st.mean_skew_us = st.sy / st.n;
+
+            //Slope in microseconds per second is parts per million
+            double den = st.n * st.sxx - st.sx * st.sx;
+            if (st.n > 1 && den > 0) st.drift_ppm = (st.n * st.sxy - st.sx * st.sy) / den;
+        }
+    }
+
+    private: c920_frame_t& front(size_t i) { return _queues[i].frames[_queues[i].head]; }
+
+    /*****************************************************
+    A recovery requeued (or, when it reopened the device, unmapped) every
+    buffer behind our back. Forget the frames from before it, never hand them
+    out or release them. Generations only grow, so stale frames are at the head.
+    ******************************************************/
+    private: void purge(size_t i)
+    {
+        while (_queues[i].size && _devices[i]->stale(front(i)))
+        {
+            _stats[i].dropped++;
+            pop(i);
+        }
+    }
+
+    private: void pop(size_t i)
+    {
+        _queues[i].head = (_queues[i].head + 1) % _queues[i].depth;
+        _queues[i].size--;
+    }
+};
+
+#endif
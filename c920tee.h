@@ -0,0 +1,343 @@
+#ifndef C920_TEE_H
+#define C920_TEE_H
+
+#include "c920capture.h"
+
+//Sink overflow policies
+const int SINK_BLOCK = 0;                 //Producer waits for room, the sink never loses frames
+const int SINK_DROP_NEWEST = 1;           //Incoming frame is dropped while the queue is full
+const int SINK_DROP_UNTIL_KEYFRAME = 2;   //After an overflow drop everything up to the next keyframe
+
+//Per sink counters
+struct c920_sink_stats_t
+{
+    public: unsigned long delivered;
+    public: unsigned long dropped;
+    public: unsigned long long bytes;
+    public: size_t max_queued;
+    public: c920_latency_t latency;       //Time from push() to the end of the sink write
+};
+
+/*****************************************************
+Fans every frame out to several sinks. The frame is copied once into a
+reference counted slab and each sink queue holds references to it, so the
+V4L2 buffer goes back to the driver immediately and a slow sink only ever
+affects its own queue. Each sink is drained by its own thread.
+******************************************************/
+class c920_tee_t
+{
+    //Return 0 to report a write error, the sink is then disabled. keyframe is what push() was given
+    public: typedef int (*c920_sink_cb)(const void* data, size_t length, bool keyframe, void* user);
+
+    public: static const size_t MAX_SINKS = 8;
+
+    private: struct _slab { char* data; size_t length; bool keyframe; long long pushed_us; volatile int refs; _slab* next; };
+
+    private: struct _sink
+    {
+        FILE* fp;
+        c920_sink_cb cb;
+        void* user;
+        int policy;
+        size_t depth;
+        _slab** queue;
+        size_t head;
+        size_t size;
+        bool skipping;
+        bool failed;
+        bool stopping;
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t not_empty;
+        pthread_cond_t not_full;
+        c920_sink_stats_t stats;
+        c920_tee_t* tee;
+    };
+
+    private: _sink _sinks[MAX_SINKS];
+    private: size_t _num_sinks;
+    private: size_t _max_frame;
+    private: bool _running;
+    private: _slab* _slabs;
+    private: size_t _num_slabs;
+    private: char* _slab_memory;
+    private: _slab* _free;
+    private: pthread_mutex_t _pool_lock;
+    private: unsigned long _starved;
+
+    //max_frame is the largest frame that will be pushed, usually c920_device_t::buffer_size()
+    public: c920_tee_t(size_t max_frame)
+    {
+        _num_sinks = 0;
+        _max_frame = max_frame;
+        _running = false;
+        _slabs = 0;
+        _num_slabs = 0;
+        _slab_memory = 0;
+        _free = 0;
+        _starved = 0;
+        pthread_mutex_init(&_pool_lock, NULL);
+    }
+
+    public: ~c920_tee_t()
+    {
+        stop();
+        for (size_t i=0; i<_num_sinks; i++)
+        {
+            free(_sinks[i].queue);
+            pthread_mutex_destroy(&_sinks[i].lock);
+            pthread_cond_destroy(&_sinks[i].not_empty);
+            pthread_cond_destroy(&_sinks[i].not_full);
+        }
+        free(_slabs);
+        free(_slab_memory);
+        pthread_mutex_destroy(&_pool_lock);
+    }
+
+    //Add a sink writing to a stream, the stream is flushed but not closed by the tee
+    public: size_t add_sink(FILE* fp, size_t depth, int policy)
+    {
+        return add_sink(fp, NULL, NULL, depth, policy);
+    }
+
+    //Add a sink delivering to a callback on the sink's own thread
+    public: size_t add_sink(c920_sink_cb cb, void* user, size_t depth, int policy)
+    {
+        return add_sink(NULL, cb, user, depth, policy);
+    }
+
+    public: const c920_sink_stats_t& stats(size_t sink) const { return _sinks[sink].stats; }
+    public: size_t num_sinks() const { return _num_sinks; }
+
+    //Frames lost because every slab was in use, should stay 0
+    public: unsigned long starved() const { return _starved; }
+
+    //Lock the slab pool for a real-time producer, call after start()
+    public: void lock_memory()
+    {
+        if (_slab_memory) c920_device_t::lock_memory(_slab_memory, _num_slabs * _max_frame);
+    }
+
+    //Allocate the slab pool and start one thread per sink
+    public: void start()
+    {
+        if (_running) return;
+
+        /*****************************************************
+        Every sink holds at most depth queued slabs plus the one it is writing,
+        one more for the producer means push() never runs out of slabs
+        ******************************************************/
+        _num_slabs = 1;
+        for (size_t i=0; i<_num_sinks; i++) _num_slabs += _sinks[i].depth + 1;
+
+        DEBUG("Allocating %d slabs of %d bytes for %d sinks", _num_slabs, _max_frame, _num_sinks);
+        _slabs = (_slab*) calloc(_num_slabs, sizeof(_slab));
+        _slab_memory = (char*) malloc(_num_slabs * _max_frame);
+        if (!_slabs || !_slab_memory) throw c920_exception_t("out of memory");
+        memset(_slab_memory, 0, _num_slabs * _max_frame);
+
+        _free = 0;
+        for (size_t i=0; i<_num_slabs; i++)
+        {
+            _slabs[i].data = _slab_memory + i * _max_frame;
+            _slabs[i].next = _free;
+            _free = &_slabs[i];
+        }
+
+        for (size_t i=0; i<_num_sinks; i++)
+        {
+            _sinks[i].stopping = false;
+            int res = pthread_create(&_sinks[i].thread, NULL, sink_main, &_sinks[i]);
+            if (res != 0)
+            {
+                errno = res;
+                throw c920_exception_t("unable to create thread for sink %d", i);
+            }
+        }
+        _running = true;
+    }
+
+    //Drain every queue and join the sink threads
+    public: void stop()
+    {
+        if (!_running) return;
+        for (size_t i=0; i<_num_sinks; i++)
+        {
+            pthread_mutex_lock(&_sinks[i].lock);
+            _sinks[i].stopping = true;
+            pthread_cond_broadcast(&_sinks[i].not_empty);
+            pthread_cond_broadcast(&_sinks[i].not_full);
+            pthread_mutex_unlock(&_sinks[i].lock);
+        }
+        for (size_t i=0; i<_num_sinks; i++) pthread_join(_sinks[i].thread, NULL);
+        _running = false;
+    }
+
+    /*****************************************************
+    Hand a frame to every sink, only SINK_BLOCK sinks can make this wait.
+    keyframe is decided by the caller on the frame as the camera produced it,
+    the pushed bytes may already be rewritten (AVCC) and are not scanned.
+    ******************************************************/
+    public: void push(const void* data, size_t length, bool keyframe)
+    {
+        if (!_running) throw c920_exception_t("tee is not started");
+        if (length > _max_frame) throw c920_exception_t("frame of %d bytes exceeds tee slab size %d", length, _max_frame);
+
+        pthread_mutex_lock(&_pool_lock);
+        _slab* slab = _free;
+        if (slab) _free = slab->next;
+        pthread_mutex_unlock(&_pool_lock);
+        if (!slab)
+        {
+            _starved++;
+            return;
+        }
+
+        memcpy(slab->data, data, length);
+        slab->length = length;
+        slab->keyframe = keyframe;
+        slab->pushed_us = now_us();
+        slab->refs = (int)_num_sinks + 1;
+
+        for (size_t i=0; i<_num_sinks; i++)
+        {
+            if (!offer(_sinks[i], slab, keyframe)) unref(slab);
+        }
+        unref(slab);
+    }
+
+    private: size_t add_sink(FILE* fp, c920_sink_cb cb, void* user, size_t depth, int policy)
+    {
+        if (_running) throw c920_exception_t("sinks must be added before start()");
+        if (_num_sinks == MAX_SINKS) throw c920_exception_t("too many sinks");
+        if (depth < 1) depth = 1;
+
+        _sink& s = _sinks[_num_sinks];
+        s.stats.delivered = 0;
+        s.stats.dropped = 0;
+        s.stats.bytes = 0;
+        s.stats.max_queued = 0;
+        s.stats.latency.reset();
+        s.fp = fp;
+        s.cb = cb;
+        s.user = user;
+        s.policy = policy;
+        s.depth = depth;
+        s.queue = (_slab**) calloc(depth, sizeof(_slab*));
+        if (!s.queue) throw c920_exception_t("out of memory");
+        s.head = 0;
+        s.size = 0;
+        s.skipping = false;
+        s.failed = false;
+        s.stopping = false;
+        s.tee = this;
+        pthread_mutex_init(&s.lock, NULL);
+        pthread_cond_init(&s.not_empty, NULL);
+        pthread_cond_init(&s.not_full, NULL);
+        return _num_sinks++;
+    }
+
+    //Apply the sink's overflow policy, true if the sink took a reference
+    private: bool offer(_sink& s, _slab* slab, bool keyframe)
+    {
+        pthread_mutex_lock(&s.lock);
+
+        if (s.failed)
+        {
+            pthread_mutex_unlock(&s.lock);
+            return false;
+        }
+
+        if (s.policy == SINK_BLOCK)
+        {
+            while (s.size == s.depth && !s.stopping && !s.failed) pthread_cond_wait(&s.not_full, &s.lock);
+        }
+        else if (s.policy == SINK_DROP_UNTIL_KEYFRAME && s.skipping)
+        {
+            if (keyframe && s.size < s.depth) s.skipping = false;
+        }
+
+        if (s.size == s.depth || s.skipping || s.failed)
+        {
+            if (s.policy == SINK_DROP_UNTIL_KEYFRAME) s.skipping = true;
+            s.stats.dropped++;
+            pthread_mutex_unlock(&s.lock);
+            return false;
+        }
+
+        s.queue[(s.head + s.size) % s.depth] = slab;
+        s.size++;
+        if (s.size > s.stats.max_queued) s.stats.max_queued = s.size;
+        pthread_cond_signal(&s.not_empty);
+        pthread_mutex_unlock(&s.lock);
+        return true;
+    }
+
+    private: void unref(_slab* slab)
+    {
+        if (__sync_sub_and_fetch(&slab->refs, 1) != 0) return;
+        pthread_mutex_lock(&_pool_lock);
+        slab->next = _free;
+        _free = slab;
+        pthread_mutex_unlock(&_pool_lock);
+    }
+
+    private: static void* sink_main(void* arg)
+    {
+        _sink& s = *(_sink*) arg;
+        c920_tee_t* tee = s.tee;
+
+        for (;;)
+        {
+            pthread_mutex_lock(&s.lock);
+            while (!s.size && !s.stopping) pthread_cond_wait(&s.not_empty, &s.lock);
+            if (!s.size)
+            {
+                pthread_mutex_unlock(&s.lock);
+                break;
+            }
+            _slab* slab = s.queue[s.head];
+            s.head = (s.head + 1) % s.depth;
+            s.size--;
+            pthread_cond_signal(&s.not_full);
+            pthread_mutex_unlock(&s.lock);
+
+            bool ok;
+            if (s.cb) ok = s.cb(slab->data, slab->length, slab->keyframe, s.user) != 0;
+            else ok = fwrite(slab->data, 1, slab->length, s.fp) == slab->length && fflush(s.fp) == 0;
+
+            if (ok)
+            {
+                s.stats.delivered++;
+                s.stats.bytes += slab->length;
+                s.stats.latency.add((long)(now_us() - slab->pushed_us));
+            }
+            else
+            {
+                DEBUG("W: sink write failed, disabling sink");
+                pthread_mutex_lock(&s.lock);
+                s.failed = true;
+                while (s.size)
+                {
+                    tee->unref(s.queue[s.head]);
+                    s.head = (s.head + 1) % s.depth;
+                    s.size--;
+                    s.stats.dropped++;
+                }
+                pthread_cond_broadcast(&s.not_full);
+                pthread_mutex_unlock(&s.lock);
+            }
+            tee->unref(slab);
+        }
+        return NULL;
+    }
+
+    private: static long long now_us()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    }
+};
+
+#endif
@@ -1,7 +1,58 @@
 //#define DEBUG
 #define MB(x) (x*1024*1024)
 #include "c920capture.h"
+#include "c920tee.h"
+#include "c920dvr.h"
+#include "c920scale.h"
+#include "c920mjpeg.h"
+#include <sys/epoll.h>
 
+//Fan-out stage when --tee is given
+static c920_tee_t* fanout = NULL;
+static FILE* tee_files[c920_tee_t::MAX_SINKS];
+static size_t tee_num_files = 0;
+
+//Circular recording when --dvr is given, fed from its own tee sink
+static c920_dvr_t* dvr = NULL;
+
+//Tee sink writing into the DVR ring. It runs on the sink thread, so a frame that does
+//not fit the ring must not throw out of it: returning 0 disables the sink instead.
+int dvr_frame(const void* data, size_t length, bool keyframe, void* user)
+{
+    timeval tv;
+    gettimeofday(&tv, NULL);
+    try { dvr->write(data, length, (int64_t)tv.tv_sec * 1000000 + tv.tv_usec, keyframe); }
+    catch (c920_exception_t &e){
+        DEBUG("W: %s", e.message());
+        return 0;
+    }
+    return 1;
+}
+
+//H264 analysis when --analyze is given, stamped with the buffer times of the analyzed camera
+static c920_h264_analyzer_t* analyzer = NULL;
+static c920_device_t* analyzed = NULL;
+static FILE* analyze_csv = NULL;
+
+//H264 rewriting stage when --nal avcc or --inject is given
+static c920_h264_rewriter_t* rewriter = NULL;
+
+//Downscaled and cropped YUYV outputs when --scale is given
+static c920_scaler_t* scaler = NULL;
+static FILE* scale_files[c920_scaler_t::MAX_OUTPUTS];
+
+//Scaled output writing raw YUYV to its file
+int scaled_frame(const void* data, size_t length, size_t width, size_t height, void* user)
+{
+    fwrite(data, 1, length, (FILE*)user);
+    return 1;
+}
+
+//MJPEG validation when --mjpeg is given, frames or multipart parts are written from tee sinks
+static c920_mjpeg_validator_t* validator = NULL;
+static c920_mjpeg_writer_t* mjpeg_files = NULL;
+static c920_mjpeg_writer_t* mjpeg_multipart = NULL;
+static bool mjpeg_drop = true;
 
 //Callback for process frame
 int process_frame(void* data, size_t length, c920_parameters_t c920_parameters)
@@ -9,10 +60,46 @@ int process_frame(void* data, size_t length, c920_parameters_t c920_parameters)
     static long bytes = 0;
     static long fcount = 0;
 
+    //Analyze the access unit as the camera produced it, at the time the camera stamped it
+    if (analyzer){
+        long long t = analyzed->timestamp_us();
+        if (!t){
+            timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            t = (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+        }
+        analyzer->analyze(data, length, t);
+    }
+
+    //Thumbnails and analytics feeds from the full frame
+    if (scaler) scaler->process(data, length);
+
+    //Trim, complete and check JPEG frames, corrupt ones are dropped unless asked to keep them
+    if (validator){
+        const void* out;
+        if (validator->process(data, length, out, length) != MJPEG_OK && mjpeg_drop)
+            return ++fcount < c920_parameters.frames ? 1 : 0;
+        data = (void*)out;
+    }
+
+    //Keyframes are found on the Annex-B access unit, before it is rewritten
+    bool keyframe = !fanout || c920_parameters.format != H264 || c920_device_t::h264_has_idr((const unsigned char*)data, length);
+
+    //Rewrite H264 framing
+    if (rewriter){
+        const void* out;
+        if (!rewriter->rewrite(data, length, out, length))
+            throw c920_exception_t("H264 access unit too large to rewrite");
+        data = (void*)out;
+    }
+
     //Save file
-    FILE* fp = (FILE*) c920_parameters.pipe;
-    fwrite(data, 1, length, fp);
-    fflush(fp);
+    if (fanout) fanout->push(data, length, keyframe);
+    else if (c920_parameters.pipe){
+        FILE* fp = (FILE*) c920_parameters.pipe;
+        fwrite(data, 1, length, fp);
+        fflush(fp);
+    }
 
     //Increment Values
     bytes+=length;
@@ -21,22 +108,267 @@ int process_frame(void* data, size_t length, c920_parameters_t c920_parameters)
     //return bytes < MB(5) ? 1 : 0;
 }
 
+//Build the tee from the output pipe plus path[:block|drop|keyframe[:depth]],...
+void setupTee(c920_parameters_t& params, c920_device_t* camera, size_t max_frame)
+{
+    fanout = new c920_tee_t(max_frame);
+    if (params.pipe && mjpeg_multipart) fanout->add_sink(c920_mjpeg_writer_t::sink, mjpeg_multipart, 8, SINK_BLOCK);
+    else if (params.pipe) fanout->add_sink((FILE*)params.pipe, 8, SINK_BLOCK);
+    if (mjpeg_files) fanout->add_sink(c920_mjpeg_writer_t::sink, mjpeg_files, 8, SINK_DROP_NEWEST);
+
+    //DVR ring as path[:megabytes[:overwrite]], default 1024MB, an existing recording is kept unless overwrite
+    if (params.dvr){
+        char* path = strdup(params.dvr);
+        char* size = strchr(path, ':');
+        if (size) *size++ = 0;
+        char* mode = size ? strchr(size, ':') : NULL;
+        if (mode) *mode++ = 0;
+        if (mode && strcmp("overwrite",mode)!=0) throw c920_exception_t("invalid --dvr option %s", mode);
+        uint64_t bytes = (uint64_t)(size && *size ? atoi(size) : 1024) * 1024 * 1024;
+        dvr = new c920_dvr_t(path, bytes, bytes / 4096, params.format, camera->width(), camera->height(), params.fps ? params.fps : 30, mode != NULL);
+        free(path);
+        fanout->add_sink(dvr_frame, NULL, 16, SINK_BLOCK);
+    }
+
+    char* specs = strdup(params.tee ? params.tee : "");
+    char* save = NULL;
+    for (char* spec = strtok_r(specs, ",", &save); spec; spec = strtok_r(NULL, ",", &save)){
+        char* path = spec;
+        char* policy = strchr(path, ':');
+        char* depth = NULL;
+        if (policy){ *policy++ = 0; depth = strchr(policy, ':'); }
+        if (depth) *depth++ = 0;
+
+        int p = SINK_DROP_NEWEST;
+        if (policy && strcmp("block",policy)==0) p = SINK_BLOCK;
+        if (policy && strcmp("keyframe",policy)==0) p = SINK_DROP_UNTIL_KEYFRAME;
+
+        FILE* fp = stdout;
+        if (strcmp("stdout",path)!=0){
+            fp = fopen(path, "wb");
+            if (!fp) throw c920_exception_t("unable to open tee sink %s", path);
+            tee_files[tee_num_files++] = fp;
+        }
+        fanout->add_sink(fp, depth ? atoi(depth) : 8, p);
+    }
+    free(specs);
+    fanout->start();
+}
+
+//Build the validator from drop|keep[,dht][,multipart][,files=PATTERN]
+void setupMjpeg(c920_parameters_t& params, c920_device_t* camera)
+{
+    if (params.format != MJPEG) throw c920_exception_t("--mjpeg needs MJPEG frames");
+
+    bool dht = false, multipart = false;
+    const char* pattern = NULL;
+    char* opts = strdup(params.mjpeg);
+    char* save = NULL;
+    for (char* opt = strtok_r(opts, ",", &save); opt; opt = strtok_r(NULL, ",", &save)){
+        if (strcmp("drop",opt)==0) mjpeg_drop = true;
+        else if (strcmp("keep",opt)==0) mjpeg_drop = false;
+        else if (strcmp("dht",opt)==0) dht = true;
+        else if (strcmp("multipart",opt)==0) multipart = true;
+        else if (strncmp("files=",opt,6)==0) pattern = opt + 6;
+        else throw c920_exception_t("invalid --mjpeg option %s", opt);
+    }
+
+    validator = new c920_mjpeg_validator_t(camera->buffer_size(), dht, camera->width(), camera->height());
+    if (multipart && !params.pipe) throw c920_exception_t("--mjpeg multipart needs -o");
+    if (multipart) mjpeg_multipart = new c920_mjpeg_writer_t(MJPEG_MULTIPART, NULL, (FILE*)params.pipe);
+    if (pattern){
+        mjpeg_files = new c920_mjpeg_writer_t(MJPEG_FILES, pattern, NULL);
+        if (!mjpeg_files->valid()) throw c920_exception_t("files= pattern %s needs exactly one integer conversion like %%06lu", pattern);
+    }
+    free(opts);
+    if (!validator->valid()) throw c920_exception_t("out of memory");
+}
+
+void teardownMjpeg()
+{
+    const c920_mjpeg_stats_t& st = validator->stats();
+    fprintf(stderr, "mjpeg: frames=%lu valid=%lu corrupt=%lu", st.frames, st.valid, st.corrupt);
+    for (int i=1; i<MJPEG_STATUSES; i++) if (st.reasons[i]) fprintf(stderr, " %s=%lu", c920_mjpeg_status_names[i], st.reasons[i]);
+    fprintf(stderr, " trimmed=%lu (%llu bytes) dht_inserted=%lu\n", st.trimmed, st.trimmed_bytes, st.dht_inserted);
+    if (mjpeg_files) fprintf(stderr, "mjpeg: wrote %lu files, %lu failed\n", mjpeg_files->frames(), mjpeg_files->errors());
+    if (mjpeg_multipart) fprintf(stderr, "mjpeg: wrote %lu multipart frames, %lu failed\n", mjpeg_multipart->frames(), mjpeg_multipart->errors());
+    delete validator;
+    delete mjpeg_files;
+    delete mjpeg_multipart;
+    validator = NULL;
+    mjpeg_files = mjpeg_multipart = NULL;
+}
+
+//Build the scaler from path:WxH[:box|bilinear|area[:fps[:x,y,w,h]]]+...
+void setupScaler(c920_parameters_t& params, c920_device_t* camera)
+{
+    if (params.format != YUYV) throw c920_exception_t("--scale needs YUYV frames");
+    scaler = new c920_scaler_t(camera->width(), camera->height(), params.fps);
+
+    char* specs = strdup(params.scale);
+    char* save = NULL;
+    for (char* spec = strtok_r(specs, "+", &save); spec; spec = strtok_r(NULL, "+", &save)){
+        char* field[5] = { spec, NULL, NULL, NULL, NULL };
+        for (int i=1; i<5 && field[i-1]; i++){
+            field[i] = strchr(field[i-1], ':');
+            if (field[i]) *field[i]++ = 0;
+        }
+
+        unsigned w = 0, h = 0, rx = 0, ry = 0, rw = camera->width(), rh = camera->height();
+        if (!field[1] || sscanf(field[1], "%ux%u", &w, &h) != 2)
+            throw c920_exception_t("invalid scale output %s", spec);
+        if (field[4] && sscanf(field[4], "%u,%u,%u,%u", &rx, &ry, &rw, &rh) != 4)
+            throw c920_exception_t("invalid scale region %s", field[4]);
+
+        int kernel = SCALE_AREA;
+        if (field[2] && strcmp("box",field[2])==0) kernel = SCALE_BOX;
+        if (field[2] && strcmp("bilinear",field[2])==0) kernel = SCALE_BILINEAR;
+
+        size_t n = scaler->num_outputs();
+        if (n == c920_scaler_t::MAX_OUTPUTS) throw c920_exception_t("too many scaled outputs");
+        scale_files[n] = fopen(field[0], "wb");
+        if (!scale_files[n]) throw c920_exception_t("unable to open scaled output %s", field[0]);
+        scaler->add_output(rx, ry, rw, rh, w, h, kernel, field[3] ? atof(field[3]) : 0, scaled_frame, scale_files[n]);
+    }
+    free(specs);
+}
+
+void teardownScaler()
+{
+    for (size_t i=0; i<scaler->num_outputs(); i++){
+        fprintf(stderr, "scaled output %zu: %lu frames\n", i, scaler->frames(i));
+        fclose(scale_files[i]);
+    }
+    delete scaler;
+    scaler = NULL;
+}
+
+void teardownTee()
+{
+    fanout->stop();
+    for (size_t i=0; i<fanout->num_sinks(); i++){
+        const c920_sink_stats_t& st = fanout->stats(i);
+        fprintf(stderr, "sink %zu: delivered=%lu dropped=%lu bytes=%llu max_queued=%zu latency avg=%ldus max=%ldus\n",
+            i, st.delivered, st.dropped, st.bytes, st.max_queued, st.latency.mean_us(), st.latency.max_us);
+    }
+    for (size_t i=0; i<tee_num_files; i++) fclose(tee_files[i]);
+    delete fanout;
+    fanout = NULL;
+    if (dvr){ delete dvr; dvr = NULL; }
+}
+
+//Drive the camera the way an external event loop would, through fd(), try_dequeue() and check_stall()
+void pullLoop(c920_device_t* camera, c920_parameters_t& params)
+{
+    int ep = epoll_create1(0);
+    if (ep == -1) throw c920_exception_t("error in epoll_create1");
+
+    int watched = -1;
+    unsigned long serial = 0;
+    int r = 1;
+    c920_lease_t lease;
+    while (r){
+        //A recovery that reopens the device has no fd until it is back, then a new one that
+        //likely reuses the old number, which closing already removed from the epoll set
+        if (camera->fd_serial() != serial || camera->fd() != watched){
+            if (watched != -1) epoll_ctl(ep, EPOLL_CTL_DEL, watched, NULL);
+            watched = camera->fd();
+            serial = camera->fd_serial();
+            epoll_event ev;
+            CLEAR(ev);
+            ev.events = EPOLLIN;
+            ev.data.fd = watched;
+            if (watched != -1 && epoll_ctl(ep, EPOLL_CTL_ADD, watched, &ev) == -1){
+                close(ep);
+                throw c920_exception_t("error in epoll_ctl");
+            }
+        }
+
+        epoll_event ev;
+        int n = epoll_wait(ep, &ev, 1, 100);
+        if (n == -1 && errno != EINTR){
+            close(ep);
+            throw c920_exception_t("error in epoll_wait");
+        }
+        while (n > 0 && r && camera->try_dequeue(lease) == PULL_FRAME){
+            r = process_frame((void*)lease.data(), lease.length(), params);
+            lease.release();
+        }
+
+        //Cheap when nothing is due, a wakeup that brought no frame still counts towards a stall
+        camera->check_stall();
+    }
+    close(ep);
+}
+
 int main(int argc, char **argv)
 {
     try
     {
         //Set params
         c920_parameters_t params;
+        CLEAR(params);
+        params.cpu=-1;
         params.cb=process_frame;
         setParametersFromArgs(params,argc,argv);
 
         //Set up camera and start it
         c920_device_t* camera = new c920_device_t(params);
 
+        if(params.format==H264 && (params.nal!=H264_ANNEXB || params.inject)){
+            rewriter = new c920_h264_rewriter_t(camera->buffer_size(), params.nal, params.inject);
+            if (!rewriter->valid()) throw c920_exception_t("out of memory");
+        }
+        size_t max_frame = camera->buffer_size();
+        if(rewriter) max_frame = c920_h264_rewriter_t::output_size(max_frame);
+        if(params.mjpeg){
+            setupMjpeg(params, camera);
+            max_frame = c920_mjpeg_validator_t::output_size(max_frame);
+        }
+        if(params.tee || params.dvr || mjpeg_files || mjpeg_multipart) setupTee(params, camera, max_frame);
+        if(params.scale) setupScaler(params, camera);
+
         //Start, capture and stop
         camera->start();
-        while(camera->process());
+
+        //Analysis compares against the bitrate the encoder reports after start() set it
+        if(params.format==H264 && params.analyze){
+            long average = camera->average_bitrate() ? camera->average_bitrate() : params.bitrate;
+            long peak = camera->peak_bitrate() ? camera->peak_bitrate() : average;
+
+            //The CSV gets its own stream, stderr also carries the device messages
+            bool csv = strncmp("csv",params.analyze,3)==0;
+            if(csv && params.analyze[3]==':'){
+                analyze_csv = fopen(params.analyze + 4, "w");
+                if(!analyze_csv) throw c920_exception_t("unable to open analysis CSV %s", params.analyze + 4);
+            }
+            else if(csv){
+                if(params.pipe==stdout || (params.tee && strstr(params.tee,"stdout"))) throw c920_exception_t("--analyze csv writes to stdout, use csv:PATH when frames go to stdout");
+                analyze_csv = stdout;
+            }
+            analyzer = new c920_h264_analyzer_t(params.fps, average, peak, 1000, params.spike, analyze_csv, csv ? NULL : stderr, 5);
+            analyzed = camera;
+        }
+        if(params.pull) pullLoop(camera, params);
+        else if(params.cpu>=0 || params.priority>0){
+            if(fanout) fanout->lock_memory();
+            camera->start_thread();
+            camera->join_thread();
+        }
+        else while(camera->process());
         camera->stop();
+        if(fanout) teardownTee();
+        if(validator) teardownMjpeg();
+        if(scaler) teardownScaler();
+        if(analyzer){
+            analyzer->summary();
+            delete analyzer;
+            if(analyze_csv && analyze_csv!=stdout) fclose(analyze_csv);
+        }
+        if(rewriter){
+            fprintf(stderr, "Injected parameter sets before %lu IDR frames\n", rewriter->injected());
+            delete rewriter;
+        }
 
         //Delete camera
         delete camera;
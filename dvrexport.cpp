@@ -0,0 +1,123 @@
+//Export a time range from a circular DVR file written by capture --dvr
+//./dvrexport -i ring.dvr -l
+//./dvrexport -i ring.dvr -s -60 -o last_minute.h264
+//./dvrexport -i ring.dvr -s 1700000000 -e 1700000300 -o stdout > clip.h264
+#include "c920dvr.h"
+
+static void usage()
+{
+    fprintf(stderr,
+        "Usage: dvrexport -i RING [-l] [-s START] [-e END] [-o FILE|stdout]\n"
+        "  -l        list what the ring holds\n"
+        "  -s START  unix time in seconds, negative is relative to the newest frame\n"
+        "  -e END    same, defaults to the newest frame\n"
+        "H264 exports start at the keyframe before START so the clip decodes.\n");
+}
+
+static bool keyframe(const c920_dvr_reader_t& ring, uint64_t seq)
+{
+    const c920_dvr_entry_t* e = ring.entry(seq);
+    return e && (e->flags & DVR_FRAME_KEYFRAME);
+}
+
+static int64_t parse_time(const char* s, int64_t newest_us)
+{
+    double t = atof(s);
+    if (t <= 0) return newest_us + (int64_t)(t * 1e6);
+    return (int64_t)(t * 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    const char* input = NULL;
+    const char* start = NULL;
+    const char* end = NULL;
+    const char* output = "stdout";
+    bool list = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "i:s:e:o:lh")) != -1)
+    {
+        switch (c)
+        {
+            case 'i': input = optarg; break;
+            case 's': start = optarg; break;
+            case 'e': end = optarg; break;
+            case 'o': output = optarg; break;
+            case 'l': list = true; break;
+            default: usage(); return EXIT_FAILURE;
+        }
+    }
+    if (!input) { usage(); return EXIT_FAILURE; }
+
+    try
+    {
+        c920_dvr_reader_t ring(input);
+        uint64_t newest = ring.newest(), oldest = ring.oldest();
+        if (!newest)
+        {
+            fprintf(stderr, "%s is empty\n", input);
+            return EXIT_FAILURE;
+        }
+        const c920_dvr_entry_t* first = ring.entry(oldest);
+        const c920_dvr_entry_t* last = ring.entry(newest);
+
+        if (list)
+        {
+            unsigned long keyframes = 0;
+            unsigned long long bytes = 0;
+            for (uint64_t s=oldest; s<=newest; s++)
+            {
+                const c920_dvr_entry_t* e = ring.entry(s);
+                if (!e) continue;
+                if (e->flags & DVR_FRAME_KEYFRAME) keyframes++;
+                bytes += e->length;
+            }
+            const c920_dvr_header_t& h = ring.header();
+            printf("format=%s size=%ux%u ring=%llu bytes\n", h.format == H264 ? "H264" : h.format == MJPEG ? "MJPEG" : "YUYV",
+                h.width, h.height, (unsigned long long)h.data_size);
+            printf("frames=%llu..%llu (%llu) keyframes=%lu bytes=%llu\n", (unsigned long long)oldest, (unsigned long long)newest,
+                (unsigned long long)(newest - oldest + 1), keyframes, bytes);
+            printf("time=%.6f..%.6f (%.1fs)\n", first->timestamp_us / 1e6, last->timestamp_us / 1e6,
+                (last->timestamp_us - first->timestamp_us) / 1e6);
+            return 0;
+        }
+
+        int64_t from = start ? parse_time(start, last->timestamp_us) : first->timestamp_us;
+        int64_t to = end ? parse_time(end, last->timestamp_us) : last->timestamp_us;
+
+        //First frame at or after the start, then back to the keyframe before it
+        uint64_t s = oldest;
+        const c920_dvr_entry_t* e;
+        while (s < newest && (e = ring.entry(s)) && e->timestamp_us < from) s++;
+        if (ring.header().format == H264)
+        {
+            while (s > oldest && !keyframe(ring, s)) s--;
+            while (s <= newest && !keyframe(ring, s)) s++;
+        }
+
+        FILE* fp = stdout;
+        if (strcmp("stdout", output) != 0 && !(fp = fopen(output, "wb")))
+            throw c920_exception_t("unable to open %s for writing", output);
+
+        unsigned long frames = 0, corrupt = 0;
+        for (; s <= newest; s++)
+        {
+            e = ring.entry(s);
+            if (!e || e->timestamp_us > to) break;
+            if (!ring.verify(*e)) { corrupt++; continue; }
+            fwrite(ring.data(*e), 1, e->length, fp);
+            frames++;
+        }
+        if (fp != stdout) fclose(fp);
+        fprintf(stderr, "Exported %lu frames (%lu corrupt skipped)\n", frames, corrupt);
+    }
+    catch (c920_exception_t &e)
+    {
+        fprintf(stderr, "%s", e.message());
+        if (e.error()) fprintf(stderr, " (%d: %s)", e.error(), strerror(e.error()));
+        fprintf(stderr, "\n");
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
@@ -0,0 +1,73 @@
+//Offline GOP and bitrate analysis of a recorded Annex-B .h264 file
+//./h264analyze -i test.h264 -p 30 -b 3000000
+//./h264analyze -i test.h264 -p 30 -m csv > frames.csv
+#include "c920capture.h"
+
+static void usage()
+{
+    fprintf(stderr,
+        "Usage: h264analyze -i FILE [-p FPS] [-b BITRATE] [-B PEAK] [-m summary|csv] [-w WINDOW_MS] [-y FACTOR] [-s SECONDS]\n"
+        "  -p FPS      frame rate the file was captured at, frame times are derived from it (30)\n"
+        "  -b BITRATE  target average bit/s as given to capture -b, -B the peak (defaults to -b)\n"
+        "  -m MODE     periodic summary on stdout (default) or a per-frame CSV\n"
+        "  -w WINDOW   sliding bitrate window in milliseconds (1000)\n"
+        "  -y FACTOR   frames larger than FACTOR times the target frame size are spikes (3)\n"
+        "  -s SECONDS  summary interval (1)\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char* input = NULL;
+    double fps = 30, factor = 3, interval = 1;
+    long average = 0, peak = 0, window = 1000;
+    bool csv = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "i:p:b:B:m:w:y:s:h")) != -1)
+    {
+        switch (c)
+        {
+            case 'i': input = optarg; break;
+            case 'p': fps = atof(optarg); break;
+            case 'b': average = atol(optarg); break;
+            case 'B': peak = atol(optarg); break;
+            case 'm': csv = strcmp("csv", optarg) == 0; break;
+            case 'w': window = atol(optarg); break;
+            case 'y': factor = atof(optarg); break;
+            case 's': interval = atof(optarg); break;
+            default: usage(); return EXIT_FAILURE;
+        }
+    }
+    if (!input || fps <= 0) { usage(); return EXIT_FAILURE; }
+    if (!peak) peak = average;
+
+    int fd = open(input, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        fprintf(stderr, "Unable to open %s: %s\n", input, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (st.st_size == 0) return 0;
+
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "Unable to map %s: %s\n", input, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    c920_h264_analyzer_t analyzer(fps, average, peak, window, factor, csv ? stdout : NULL, csv ? NULL : stdout, interval);
+
+    //Frame times come from the frame rate
+    c920_nal_reader_t reader(data, st.st_size);
+    c920_nal_t nal;
+    while (reader.next(nal)) analyzer.feed(nal);
+    analyzer.flush();
+    analyzer.summary();
+
+    munmap(data, st.st_size);
+    close(fd);
+    return 0;
+}
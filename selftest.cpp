@@ -0,0 +1,283 @@
+//Checks of the pure stages on synthetic data, no camera needed. Run by ctest, or directly:
+//./selftest    # prints every failed check, exit status is the number of failures
+#include "c920capture.h"
+#include "c920dvr.h"
+#include "c920h264.h"
+#include "c920mjpeg.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { failures++; fprintf(stderr, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); } } while (0)
+
+//Deterministic frame content, frame i is 100 + 37 * i bytes
+static size_t make_payload(unsigned char* p, int i)
+{
+    size_t n = 100 + 37 * i;
+    for (size_t k=0; k<n; k++) p[k] = (unsigned char)(i * 31 + k * 7);
+    return n;
+}
+
+/*****************************************************
+DVR crash recovery: frames written after the last commit are still found
+when their index entries and data check out, and the walk stops at the
+first frame whose data was torn.
+******************************************************/
+static void test_dvr_recovery()
+{
+    char path[] = "/tmp/c920selftestXXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd != -1);
+    if (fd == -1) return;
+    close(fd);
+
+    //Commit every 4 frames and never destroy the writer, as if the process died after frame 10
+    unsigned char frame[1024];
+    c920_dvr_t* ring = new c920_dvr_t(path, 1 << 20, 64, H264, 640, 480, 4, false);
+    for (int i=1; i<=10; i++)
+    {
+        size_t n = make_payload(frame, i);
+        ring->write(frame, n, i * 33333, i == 1);
+    }
+
+    uint64_t data_offset = 0, position = 0;
+    {
+        c920_dvr_reader_t reader(path);
+        CHECK(reader.header().commit[0].seq == 8 || reader.header().commit[1].seq == 8);
+        CHECK(reader.newest() == 10);
+        CHECK(reader.oldest() == 1);
+        for (uint64_t s=1; s<=10; s++)
+        {
+            const c920_dvr_entry_t* e = reader.entry(s);
+            CHECK(e != NULL);
+            if (!e) continue;
+            CHECK(reader.verify(*e));
+            size_t n = make_payload(frame, (int)s);
+            CHECK(e->length == n && memcmp(reader.data(*e), frame, n) == 0);
+        }
+        CHECK((reader.entry(1)->flags & DVR_FRAME_KEYFRAME) != 0);
+        data_offset = reader.header().data_offset;
+        position = reader.entry(10)->position % reader.header().data_size;
+    }
+
+    //Tear the data of the uncommitted frame 10, recovery has to stop at 9
+    fd = open(path, O_RDWR);
+    unsigned char byte = 0x5A;
+    CHECK(pwrite(fd, &byte, 1, data_offset + position + 50) == 1);
+    close(fd);
+    {
+        c920_dvr_reader_t reader(path);
+        CHECK(reader.newest() == 9);
+        CHECK(reader.entry(10) == NULL);
+        CHECK(reader.entry(9) && reader.verify(*reader.entry(9)));
+    }
+
+    //The writer picks up after the recovered frames
+    {
+        c920_dvr_t resumed(path, 1 << 20, 64, H264, 640, 480, 4, false);
+        CHECK(resumed.newest() == 9);
+        size_t n = make_payload(frame, 11);
+        resumed.write(frame, n, 11 * 33333, false);
+        CHECK(resumed.newest() == 10);
+    }
+    {
+        c920_dvr_reader_t reader(path);
+        CHECK(reader.newest() == 10);
+        CHECK(reader.entry(10) && reader.entry(10)->length == make_payload(frame, 11));
+    }
+
+    unlink(path);
+}
+
+//Collect the NAL units of an Annex-B buffer
+static size_t annexb_nals(const void* data, size_t length, c920_nal_t* nals, size_t max)
+{
+    c920_nal_reader_t reader(data, length);
+    size_t n = 0;
+    while (n < max && reader.next(nals[n])) n++;
+    return n;
+}
+
+//Split an AVCC buffer at its 4 byte length prefixes, 0 if a length runs past the end
+static size_t avcc_nals(const void* data, size_t length, c920_nal_t* nals, size_t max)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    const unsigned char* end = p + length;
+    size_t n = 0;
+    while (p < end && n < max)
+    {
+        if (end - p < 4) return 0;
+        size_t len = ((size_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+        p += 4;
+        if ((size_t)(end - p) < len) return 0;
+        nals[n].data = p;
+        nals[n].length = len;
+        nals[n].type = p[0] & 0x1f;
+        n++;
+        p += len;
+    }
+    return n;
+}
+
+static bool same_nals(const c920_nal_t* a, size_t na, const c920_nal_t* b, size_t nb)
+{
+    if (na != nb) return false;
+    for (size_t i=0; i<na; i++)
+        if (a[i].length != b[i].length || memcmp(a[i].data, b[i].data, a[i].length) != 0) return false;
+    return true;
+}
+
+/*****************************************************
+H264 rewriting: Annex-B with 3 and 4 byte start codes to AVCC and back
+keeps every NAL byte for byte, injection puts the cached SPS/PPS in front of
+a bare IDR, and Annex-B output is only copied when something is injected.
+******************************************************/
+static void test_h264_rewrite()
+{
+    //AUD and SPS behind 4 byte start codes, PPS and IDR behind 3 byte ones, a trailing zero after the PPS
+    static const unsigned char keyframe[] = {
+        0x00, 0x00, 0x00, 0x01, 0x09, 0x10,
+        0x00, 0x00, 0x00, 0x01, 0x67, 0x64, 0x00, 0x28, 0xAC, 0x2B, 0x40, 0x3C,
+        0x00, 0x00, 0x01, 0x68, 0xEE, 0x3C, 0xB0, 0x00,
+        0x00, 0x00, 0x01, 0x65, 0x88, 0x84, 0x21, 0x43, 0x65, 0x87, 0xA9 };
+    static const unsigned char pframe[] = { 0x00, 0x00, 0x01, 0x41, 0x9A, 0x02, 0x13, 0x57 };
+    static const unsigned char bare_idr[] = { 0x00, 0x00, 0x00, 0x01, 0x65, 0x88, 0x80, 0x11, 0x22 };
+
+    c920_nal_t in[8], out[8], back[8];
+    size_t n_in = annexb_nals(keyframe, sizeof(keyframe), in, 8);
+    CHECK(n_in == 4);
+    CHECK(in[2].type == NAL_PPS && in[2].length == 4);
+
+    c920_h264_rewriter_t avcc(256, H264_AVCC, false);
+    CHECK(avcc.valid());
+    const void* data;
+    size_t length;
+    CHECK(avcc.rewrite(keyframe, sizeof(keyframe), data, length));
+    size_t n_out = avcc_nals(data, length, out, 8);
+    CHECK(same_nals(in, n_in, out, n_out));
+    CHECK(avcc.has_parameter_sets());
+
+    //Back to Annex-B with 4 byte start codes
+    unsigned char annexb[256];
+    size_t n = 0;
+    for (size_t i=0; i<n_out; i++)
+    {
+        static const unsigned char start[] = { 0x00, 0x00, 0x00, 0x01 };
+        memcpy(annexb + n, start, 4);
+        memcpy(annexb + n + 4, out[i].data, out[i].length);
+        n += 4 + out[i].length;
+    }
+    size_t n_back = annexb_nals(annexb, n, back, 8);
+    CHECK(same_nals(in, n_in, back, n_back));
+
+    //A P frame keeps its single NAL
+    CHECK(avcc.rewrite(pframe, sizeof(pframe), data, length));
+    n_out = avcc_nals(data, length, out, 8);
+    CHECK(n_out == 1 && out[0].type == NAL_SLICE && out[0].length == sizeof(pframe) - 3);
+
+    //AVCC with injection: the bare IDR gets the SPS and PPS of the keyframe
+    c920_h264_rewriter_t inject(256, H264_AVCC, true);
+    CHECK(inject.rewrite(keyframe, sizeof(keyframe), data, length));
+    CHECK(inject.injected() == 0);
+    CHECK(inject.rewrite(bare_idr, sizeof(bare_idr), data, length));
+    CHECK(inject.injected() == 1);
+    n_out = avcc_nals(data, length, out, 8);
+    CHECK(n_out == 3);
+    if (n_out == 3)
+    {
+        CHECK(same_nals(&in[1], 2, out, 2));
+        CHECK(out[2].type == NAL_IDR && out[2].length == sizeof(bare_idr) - 4);
+    }
+
+    //Annex-B with injection copies only the bare IDR
+    c920_h264_rewriter_t annexb_inject(256, H264_ANNEXB, true);
+    CHECK(annexb_inject.rewrite(keyframe, sizeof(keyframe), data, length));
+    CHECK(data == (const void*)keyframe && length == sizeof(keyframe));
+    CHECK(annexb_inject.rewrite(pframe, sizeof(pframe), data, length));
+    CHECK(data == (const void*)pframe && length == sizeof(pframe));
+    CHECK(annexb_inject.rewrite(bare_idr, sizeof(bare_idr), data, length));
+    CHECK(data != (const void*)bare_idr && annexb_inject.injected() == 1);
+    n_back = annexb_nals(data, length, back, 8);
+    CHECK(n_back == 3 && same_nals(&in[1], 2, back, 2) && back[2].type == NAL_IDR);
+}
+
+//A 64x48 baseline JPEG without DHT as UVC sends it, with byte stuffing and a restart marker in the scan
+static size_t make_jpeg(unsigned char* p)
+{
+    static const unsigned char head[] = {
+        0xFF, 0xD8,
+        0xFF, 0xE0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0x00, 0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00 };
+    static const unsigned char sof[] = { 0xFF, 0xC0, 0x00, 0x11, 0x08, 0x00, 0x30, 0x00, 0x40,
+        0x03, 0x01, 0x21, 0x00, 0x02, 0x11, 0x00, 0x03, 0x11, 0x00 };
+    static const unsigned char sos[] = { 0xFF, 0xDA, 0x00, 0x0C, 0x03, 0x01, 0x00, 0x02, 0x11, 0x03, 0x11, 0x00, 0x3F, 0x00 };
+    static const unsigned char scan[] = { 0x12, 0x34, 0xFF, 0x00, 0x56, 0xFF, 0xD0, 0x78, 0x9A, 0xBC };
+
+    size_t n = 0;
+    memcpy(p + n, head, sizeof(head)); n += sizeof(head);
+    p[n++] = 0xFF; p[n++] = 0xDB; p[n++] = 0x00; p[n++] = 0x43; p[n++] = 0x00;
+    for (int i=0; i<64; i++) p[n++] = 1 + i;
+    memcpy(p + n, sof, sizeof(sof)); n += sizeof(sof);
+    memcpy(p + n, sos, sizeof(sos)); n += sizeof(sos);
+    memcpy(p + n, scan, sizeof(scan)); n += sizeof(scan);
+    p[n++] = 0xFF; p[n++] = 0xD9;
+    return n;
+}
+
+/*****************************************************
+MJPEG validation: a whole frame passes untouched, bytes after EOI are
+trimmed, frames cut short in a segment or in the scan are flagged as
+truncated, and the DHT goes in front of SOS when asked for.
+******************************************************/
+static void test_mjpeg_validate()
+{
+    unsigned char frame[512];
+    size_t n = make_jpeg(frame);
+    const void* out;
+    size_t length;
+
+    c920_mjpeg_validator_t validator(sizeof(frame), false, 64, 48);
+    CHECK(validator.process(frame, n, out, length) == MJPEG_OK);
+    CHECK(out == (const void*)frame && length == n);
+
+    //Padding after EOI, as the driver leaves it in the buffer
+    memset(frame + n, 0, 40);
+    CHECK(validator.process(frame, n + 40, out, length) == MJPEG_OK);
+    CHECK(out == (const void*)frame && length == n);
+    CHECK(validator.stats().trimmed == 1 && validator.stats().trimmed_bytes == 40);
+
+    //Cut inside the scan, in the middle of the EOI and inside the DQT segment
+    CHECK(validator.process(frame, n - 5, out, length) == MJPEG_TRUNCATED);
+    CHECK(validator.process(frame, n - 1, out, length) == MJPEG_TRUNCATED);
+    CHECK(validator.process(frame, 40, out, length) == MJPEG_TRUNCATED);
+    CHECK(validator.stats().reasons[MJPEG_TRUNCATED] == 3);
+    CHECK(validator.stats().corrupt == 3 && validator.stats().valid == 2);
+
+    //Not a JPEG, and a SOF of another size
+    CHECK(validator.process(frame + 2, n - 2, out, length) == MJPEG_NO_SOI);
+    c920_mjpeg_validator_t sized(sizeof(frame), false, 640, 480);
+    CHECK(sized.process(frame, n, out, length) == MJPEG_BAD_SIZE);
+
+    //DHT insertion keeps the frame valid and puts the tables right before SOS
+    c920_mjpeg_validator_t dht(sizeof(frame), true, 64, 48);
+    CHECK(dht.valid());
+    CHECK(dht.process(frame, n + 40, out, length) == MJPEG_OK);
+    CHECK(length == n + c920_mjpeg_validator_t::DHT_SIZE);
+    const unsigned char* o = (const unsigned char*)out;
+    size_t sos = n - 10 - 2 - 14;
+    CHECK(memcmp(o, frame, sos) == 0);
+    CHECK(o[sos] == 0xFF && o[sos + 1] == 0xC4);
+    CHECK(memcmp(o + sos + c920_mjpeg_validator_t::DHT_SIZE, frame + sos, n - sos) == 0);
+    c920_mjpeg_info_t info;
+    CHECK(validator.check(out, length, info) == MJPEG_OK && info.has_dht);
+    CHECK(dht.stats().dht_inserted == 1);
+}
+
+int main(int argc, char **argv)
+{
+    test_dvr_recovery();
+    test_h264_rewrite();
+    test_mjpeg_validate();
+
+    if (failures) fprintf(stderr, "%d checks failed\n", failures);
+    else fprintf(stderr, "all checks passed\n");
+    return failures;
+}
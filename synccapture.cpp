@@ -0,0 +1,142 @@
+//Synchronized capture from several cameras through c920_sync_t, prints the tuple skew and drift
+//./synccapture -d /dev/video0 -d /dev/video1 -W 640 -H 480 -f MJPEG -p 30 -c 300
+//./synccapture -d /dev/video0 -d /dev/video1 -f H264 -c 900 -S 5 -o cam
+#include "c920sync.h"
+
+static const size_t MAX_CAMERAS = 8;
+
+struct sync_output_t
+{
+    public: FILE* files[MAX_CAMERAS];
+    public: long tuples;
+    public: long partial;
+    public: long limit;
+};
+
+static void usage()
+{
+    fprintf(stderr,
+        "Usage: synccapture -d DEVICE -d DEVICE [...] [-W WIDTH] [-H HEIGHT] [-f YUYV|MJPEG|H264] [-p FPS] [-b BITRATE]\n"
+        "                   [-c TUPLES] [-t TOLERANCE_US] [-q DEPTH] [-n] [-S STALL_FRAMES] [-o PREFIX]\n"
+        "  -d DEVICE     camera to synchronize, repeat for up to 8 cameras, the first one is the reference\n"
+        "  -c TUPLES     stop after this many tuples (300)\n"
+        "  -t TOLERANCE  largest timestamp offset within a tuple in microseconds (half a frame interval)\n"
+        "  -q DEPTH      frames queued per camera while waiting for the others (2)\n"
+        "  -n            drop partial tuples instead of delivering them with missing frames\n"
+        "  -S FRAMES     recover a camera after this many silent frame intervals, 0 throws after 2s\n"
+        "  -o PREFIX     write camera i to PREFIXi, frames of a tuple are written together\n");
+}
+
+static int on_tuple(const c920_frame_t* const* frames, size_t count, void* user)
+{
+    sync_output_t* out = (sync_output_t*) user;
+    bool partial = false;
+    for (size_t i=0; i<count; i++)
+    {
+        if (!frames[i]) { partial = true; continue; }
+        if (out->files[i] && fwrite(frames[i]->data, frames[i]->length, 1, out->files[i]) != 1)
+        {
+            fprintf(stderr, "Unable to write camera %d: %s\n", (int)i, strerror(errno));
+            return 0;
+        }
+    }
+    if (partial) out->partial++;
+    return ++out->tuples < out->limit ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char* devices[MAX_CAMERAS];
+    size_t count = 0, depth = 2;
+    long tolerance = 0;
+    bool partial = true;
+    const char* prefix = NULL;
+
+    c920_parameters_t params;
+    CLEAR(params);
+    params.cpu = -1;
+    params.width = 640;
+    params.height = 480;
+    params.fps = 30;
+    params.format = MJPEG;
+
+    sync_output_t out;
+    CLEAR(out);
+    out.limit = 300;
+
+    int c;
+    while ((c = getopt(argc, argv, "d:W:H:f:p:b:c:t:q:nS:o:h")) != -1)
+    {
+        switch (c)
+        {
+            case 'd':
+                if (count == MAX_CAMERAS) { fprintf(stderr, "At most %d cameras\n", (int)MAX_CAMERAS); return EXIT_FAILURE; }
+                devices[count++] = optarg;
+                break;
+            case 'W': params.width = atoi(optarg); break;
+            case 'H': params.height = atoi(optarg); break;
+            case 'f':
+                if (strcmp("YUYV", optarg) == 0) params.format = YUYV;
+                else if (strcmp("MJPEG", optarg) == 0) params.format = MJPEG;
+                else if (strcmp("H264", optarg) == 0) params.format = H264;
+                else { usage(); return EXIT_FAILURE; }
+                break;
+            case 'p': params.fps = atoi(optarg); break;
+            case 'b': params.bitrate = atoi(optarg); break;
+            case 'c': out.limit = atol(optarg); break;
+            case 't': tolerance = atol(optarg); break;
+            case 'q': depth = atoi(optarg); break;
+            case 'n': partial = false; break;
+            case 'S': params.stall_frames = atoi(optarg); break;
+            case 'o': prefix = optarg; break;
+            default: usage(); return EXIT_FAILURE;
+        }
+    }
+    if (!count || !params.fps || out.limit <= 0) { usage(); return EXIT_FAILURE; }
+    if (!tolerance) tolerance = 500000L / (long)params.fps;
+
+    c920_device_t* cameras[MAX_CAMERAS];
+    CLEAR(cameras);
+    int status = 0;
+    try
+    {
+        for (size_t i=0; i<count; i++)
+        {
+            params.device_name = devices[i];
+            cameras[i] = new c920_device_t(params);
+            if (prefix)
+            {
+                char path[1024];
+                snprintf(path, sizeof(path), "%s%d", prefix, (int)i);
+                out.files[i] = fopen(path, "wb");
+                if (!out.files[i]) throw c920_exception_t("unable to open %s", path);
+            }
+        }
+
+        c920_sync_t sync(cameras, count, tolerance, depth, partial, on_tuple, &out);
+        for (size_t i=0; i<count; i++) cameras[i]->start();
+        while (sync.process());
+        for (size_t i=0; i<count; i++) cameras[i]->stop();
+
+        fprintf(stderr, "%ld tuples, %ld partial, tolerance %ldus\n", out.tuples, out.partial, tolerance);
+        fprintf(stderr, "camera,device,frames,matched,missing,dropped,last_skew_us,mean_skew_us,drift_ppm\n");
+        for (size_t i=0; i<count; i++)
+        {
+            const c920_sync_stats_t& s = sync.stats(i);
+            fprintf(stderr, "%d,%s,%lu,%lu,%lu,%lu,%ld,%.1f,%.2f\n", (int)i, devices[i],
+                s.frames, s.matched, s.missing, s.dropped, s.last_skew_us, s.mean_skew_us, s.drift_ppm);
+        }
+    }
+    catch (c920_exception_t &e)
+    {
+        fprintf(stderr, "%s\n", e.message());
+        status = EXIT_FAILURE;
+    }
+
+    for (size_t i=0; i<count; i++)
+    {
+        if (out.files[i]) fclose(out.files[i]);
+        delete cameras[i];
+    }
+    return status;
+}